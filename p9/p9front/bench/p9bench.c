@@ -0,0 +1,487 @@
+/*
+ * p9bench - file system benchmark for the Xen 9p transport
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  Runs a fixed set of scenarios in a directory of a mounted 9p file
+ *  system, so that transports (trans=xen against the loopback backend or
+ *  a real one, trans=virtio, ...) and msize values can be compared on the
+ *  same footing:
+ *
+ *    seqwrite   write a file from start to end in blocks of -b bytes
+ *    seqread    read that file back the same way
+ *    randwrite  -r 4K writes at random 4K aligned offsets of the file
+ *    randread   -r 4K reads the same way
+ *    meta       create, stat and unlink -n empty files
+ *    readdir    list a directory of -e entries, -R times
+ *
+ *  Every system call of a scenario is timed.  Each scenario prints one
+ *  line of JSON with its throughput and the p50, p99 and p99.9 of those
+ *  latencies; p9bench.sh gathers the lines of several mounts into one
+ *  report.  The file system should be mounted without a cache
+ *  (cache=none, the default of v9fs) so every call reaches the transport.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define RAND_BS		4096
+#define MAX_EXTRA	16
+#define ENTRY_LEN	(PATH_MAX + 32)	/* a directory and a name in it */
+
+struct bench {
+	const char	*dir;
+	char		file[ENTRY_LEN];
+	size_t		bs;		/* sequential block size */
+	uint64_t	file_size;
+	unsigned long	rand_ops;
+	unsigned long	meta_files;
+	unsigned long	dir_entries;
+	unsigned int	dir_rounds;
+	const char	*extra[MAX_EXTRA];	/* key=value pairs to report */
+	int		nr_extra;
+	char		*buf;
+};
+
+/*
+ * struct result - what a scenario measured
+ * @lat: latency of each call, in ns
+ */
+struct result {
+	const char	*name;
+	size_t		bs;
+	uint64_t	*lat;
+	unsigned long	nr_lat;
+	unsigned long	ops;
+	uint64_t	bytes;
+	uint64_t	elapsed;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(uint64_t *lat, unsigned long n, double pct)
+{
+	unsigned long k = (unsigned long) (pct / 100.0 * (n - 1) + 0.5);
+
+	return lat[k] / 1000.0;
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "p9bench: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static uint64_t *alloc_lat(unsigned long n)
+{
+	uint64_t *lat = calloc(n ? n : 1, sizeof(*lat));
+
+	if (!lat)
+		die("calloc");
+	return lat;
+}
+
+/* a value is reported as a number if it reads as one, else as a string */
+static void print_value(const char *val)
+{
+	char *end;
+
+	strtod(val, &end);
+	if (*val && !*end)
+		printf("%s", val);
+	else
+		printf("\"%s\"", val);
+}
+
+static void report(struct bench *b, struct result *r)
+{
+	double secs = r->elapsed / 1e9;
+	unsigned long n = r->nr_lat;
+	uint64_t sum = 0;
+	unsigned long i;
+	int k;
+
+	qsort(r->lat, n, sizeof(*r->lat), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += r->lat[i];
+
+	printf("{\"scenario\":\"%s\"", r->name);
+	for (k = 0; k < b->nr_extra; k++) {
+		const char *eq = strchr(b->extra[k], '=');
+
+		printf(",\"%.*s\":", (int) (eq - b->extra[k]), b->extra[k]);
+		print_value(eq + 1);
+	}
+	if (r->bs)
+		printf(",\"bs\":%zu", r->bs);
+	printf(",\"ops\":%lu,\"bytes\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f",
+	       r->ops, (unsigned long long) r->bytes, secs, r->ops / secs);
+	if (r->bytes)
+		printf(",\"mb_per_sec\":%.2f", r->bytes / secs / 1e6);
+	if (n)
+		printf(",\"lat_us\":{\"calls\":%lu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+		       n, sum / 1000.0 / n, pct_us(r->lat, n, 50),
+		       pct_us(r->lat, n, 99), pct_us(r->lat, n, 99.9),
+		       r->lat[n - 1] / 1000.0);
+	printf("}\n");
+	fflush(stdout);
+	free(r->lat);
+}
+
+/*
+ * fill - write the file, untimed, if a scenario needs it and seqwrite
+ *        did not run first
+ */
+static void fill(struct bench *b)
+{
+	uint64_t done = 0;
+	struct stat st;
+	ssize_t ret;
+	int fd;
+
+	if (!stat(b->file, &st) && (uint64_t) st.st_size >= b->file_size)
+		return;
+	fd = open(b->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die(b->file);
+	while (done < b->file_size) {
+		ret = write(fd, b->buf, b->file_size - done < b->bs ?
+				       b->file_size - done : b->bs);
+		if (ret <= 0)
+			die("write");
+		done += ret;
+	}
+	close(fd);
+}
+
+/*
+ * seq - write or read the whole file in blocks of bs
+ */
+static void seq(struct bench *b, int is_write)
+{
+	unsigned long n = (b->file_size + b->bs - 1) / b->bs;
+	struct result r = {
+		.name = is_write ? "seqwrite" : "seqread",
+		.bs = b->bs,
+		.lat = alloc_lat(n),
+	};
+	uint64_t start, t;
+	ssize_t ret;
+	int fd;
+
+	if (!is_write)
+		fill(b);
+	fd = open(b->file, is_write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY,
+		  0644);
+	if (fd < 0)
+		die(b->file);
+	start = now_ns();
+	while (r.bytes < b->file_size) {
+		size_t len = b->bs;
+
+		if (len > b->file_size - r.bytes)
+			len = b->file_size - r.bytes;
+		t = now_ns();
+		ret = is_write ? write(fd, b->buf, len) : read(fd, b->buf, len);
+		r.lat[r.nr_lat++] = now_ns() - t;
+		if (ret <= 0)
+			die(is_write ? "write" : "read");
+		r.bytes += ret;
+		r.ops++;
+	}
+	if (is_write && fsync(fd))
+		die("fsync");
+	r.elapsed = now_ns() - start;
+	close(fd);
+	report(b, &r);
+}
+
+/*
+ * rnd - 4K reads or writes at random offsets of the file
+ */
+static void rnd(struct bench *b, int is_write)
+{
+	uint64_t blocks = b->file_size / RAND_BS, start, t;
+	struct result r = {
+		.name = is_write ? "randwrite" : "randread",
+		.bs = RAND_BS,
+		.lat = alloc_lat(b->rand_ops),
+	};
+	unsigned int seed = 9;
+	unsigned long i;
+	ssize_t ret;
+	off_t off;
+	int fd;
+
+	if (!blocks)
+		return;
+	fill(b);
+	fd = open(b->file, is_write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		die(b->file);
+	start = now_ns();
+	for (i = 0; i < b->rand_ops; i++) {
+		off = (off_t) (rand_r(&seed) % blocks) * RAND_BS;
+		t = now_ns();
+		ret = is_write ? pwrite(fd, b->buf, RAND_BS, off) :
+			      pread(fd, b->buf, RAND_BS, off);
+		r.lat[r.nr_lat++] = now_ns() - t;
+		if (ret != RAND_BS)
+			die(is_write ? "pwrite" : "pread");
+		r.bytes += ret;
+		r.ops++;
+	}
+	r.elapsed = now_ns() - start;
+	close(fd);
+	report(b, &r);
+}
+
+static void entry_name(char *name, const char *dir, const char *prefix,
+		       unsigned long i)
+{
+	snprintf(name, ENTRY_LEN, "%s/%s%08lu", dir, prefix, i);
+}
+
+/*
+ * meta - create, stat and unlink files; an op is one of the three calls
+ */
+static void meta(struct bench *b)
+{
+	unsigned long n = b->meta_files, i;
+	struct result r = {
+		.name = "meta",
+		.lat = alloc_lat(3 * n),
+	};
+	char name[ENTRY_LEN];
+	struct stat st;
+	uint64_t start, t;
+	int fd, pass;
+
+	start = now_ns();
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < n; i++) {
+			entry_name(name, b->dir, "m", i);
+			t = now_ns();
+			switch (pass) {
+			case 0:
+				fd = open(name, O_WRONLY | O_CREAT | O_EXCL,
+					  0644);
+				if (fd < 0 || close(fd))
+					die("create");
+				break;
+			case 1:
+				if (stat(name, &st))
+					die("stat");
+				break;
+			case 2:
+				if (unlink(name))
+					die("unlink");
+				break;
+			}
+			r.lat[r.nr_lat++] = now_ns() - t;
+			r.ops++;
+		}
+	}
+	r.elapsed = now_ns() - start;
+	report(b, &r);
+}
+
+/*
+ * readdir - list a large directory; the latencies are of getdents64
+ * calls, an op is an entry listed
+ */
+static void readdir_bench(struct bench *b)
+{
+	char sub[PATH_MAX], name[ENTRY_LEN], buf[32768];
+	struct result r = { .name = "readdir" };
+	unsigned long i, cap = 1024;
+	unsigned int round;
+	uint64_t start, t;
+	long ret;
+	int fd;
+
+	snprintf(sub, sizeof(sub), "%s/dir", b->dir);
+	if (mkdir(sub, 0755))
+		die(sub);
+	for (i = 0; i < b->dir_entries; i++) {
+		entry_name(name, sub, "e", i);
+		fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0 || close(fd))
+			die("create");
+	}
+
+	r.lat = alloc_lat(cap);
+	start = now_ns();
+	for (round = 0; round < b->dir_rounds; round++) {
+		fd = open(sub, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			die(sub);
+		do {
+			t = now_ns();
+			ret = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+			if (r.nr_lat == cap) {
+				cap *= 2;
+				r.lat = realloc(r.lat, cap * sizeof(*r.lat));
+				if (!r.lat)
+					die("realloc");
+			}
+			r.lat[r.nr_lat++] = now_ns() - t;
+			if (ret < 0)
+				die("getdents64");
+		} while (ret > 0);
+		close(fd);
+	}
+	r.elapsed = now_ns() - start;
+	/* the entries listed, "." and ".." aside */
+	r.ops = (unsigned long) b->dir_entries * b->dir_rounds;
+	report(b, &r);
+
+	for (i = 0; i < b->dir_entries; i++) {
+		entry_name(name, sub, "e", i);
+		unlink(name);
+	}
+	rmdir(sub);
+}
+
+static unsigned long long parse_size(const char *arg)
+{
+	char *end;
+	unsigned long long v = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -d dir [-s scenario,...] [-b bs] [-f file-size] [-r ops]\n"
+		"          [-n files] [-e entries] [-R rounds] [-x key=value]...\n"
+		"  -d  directory to run in, on the file system to measure\n"
+		"  -s  scenarios (default seqwrite,seqread,randwrite,randread,meta,readdir)\n"
+		"  -b  block size of sequential I/O (default 1M)\n"
+		"  -f  size of the file for sequential and random I/O (default 256M)\n"
+		"  -r  random 4K operations (default 20000)\n"
+		"  -n  files created, stat'ed and unlinked (default 5000)\n"
+		"  -e  entries of the directory listed (default 20000)\n"
+		"  -R  times the directory is listed (default 5)\n"
+		"  -x  add key=value to every result, e.g. -x msize=65536\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char scenarios_default[] = "seqwrite,seqread,randwrite,randread,meta,readdir";
+	char *scenarios = scenarios_default;
+	struct bench b = {
+		.bs = 1 << 20,
+		.file_size = 256ULL << 20,
+		.rand_ops = 20000,
+		.meta_files = 5000,
+		.dir_entries = 20000,
+		.dir_rounds = 5,
+	};
+	char *tok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:s:b:f:r:n:e:R:x:")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.dir = optarg;
+			break;
+		case 's':
+			scenarios = optarg;
+			break;
+		case 'b':
+			b.bs = parse_size(optarg);
+			break;
+		case 'f':
+			b.file_size = parse_size(optarg);
+			break;
+		case 'r':
+			b.rand_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.meta_files = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			b.dir_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			b.dir_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			if (b.nr_extra == MAX_EXTRA || !strchr(optarg, '=') ||
+			    *optarg == '=')
+				usage(argv[0]);
+			b.extra[b.nr_extra++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!b.dir || !b.bs || !b.dir_rounds)
+		usage(argv[0]);
+	snprintf(b.file, sizeof(b.file), "%s/data", b.dir);
+	b.buf = aligned_alloc(4096, (b.bs + 4095) & ~4095UL);
+	if (!b.buf)
+		die("aligned_alloc");
+	memset(b.buf, 0x5a, b.bs);
+
+	for (tok = strtok(scenarios, ","); tok; tok = strtok(NULL, ",")) {
+		if (!strcmp(tok, "seqwrite"))
+			seq(&b, 1);
+		else if (!strcmp(tok, "seqread"))
+			seq(&b, 0);
+		else if (!strcmp(tok, "randwrite"))
+			rnd(&b, 1);
+		else if (!strcmp(tok, "randread"))
+			rnd(&b, 0);
+		else if (!strcmp(tok, "meta"))
+			meta(&b);
+		else if (!strcmp(tok, "readdir"))
+			readdir_bench(&b);
+		else
+			usage(argv[0]);
+	}
+	unlink(b.file);
+	return 0;
+}
@@ -0,0 +1,99 @@
+#!/bin/sh
+# p9bench.sh - run p9bench on one 9p mount per msize and gather the
+# results in one JSON report (an array of the lines p9bench prints).
+#
+#   p9bench.sh [-t trans] [-T tag] [-m msize,...] [-L dir] [-o report]
+#              [-- p9bench options]
+#
+#   -t  transport to mount with (default xen; virtio for a baseline)
+#   -T  mount tag (default loop with -L, p9 otherwise)
+#   -m  msize values to mount with (default 8192,65536,262144,512000);
+#       each result records the msize the mount actually got, which the
+#       transport may have lowered, and the one asked for
+#   -L  load ../p9frontall.ko with its loopback backend serving dir, so
+#       the xen transport can be measured without a Xen host
+#   -o  file to write the report to (default stdout)
+#
+# Needs root (sudo) to load the module and mount.  Example, comparing the
+# loopback device with virtio-9p in a KVM guest:
+#
+#   ./p9bench.sh -L /srv/export -o xen.json
+#   ./p9bench.sh -t virtio -T hostshare -o virtio.json -- -f 64M
+
+trans=xen
+tag=
+msizes=8192,65536,262144,512000
+loopdir=
+out=
+mnt=/tmp/p9bench.mnt.$$
+here=$(dirname "$0")
+
+while getopts t:T:m:L:o: opt; do
+	case $opt in
+	t) trans=$OPTARG ;;
+	T) tag=$OPTARG ;;
+	m) msizes=$OPTARG ;;
+	L) loopdir=$OPTARG ;;
+	o) out=$OPTARG ;;
+	*) sed -n '2,21p' "$0" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ -x "$here/p9bench" ] || make -C "$here" p9bench >&2 || exit 1
+if [ -n "$loopdir" ]; then
+	tag=${tag:-loop}
+	if ! grep -q '^p9frontall ' /proc/modules; then
+		sudo insmod "$here/../p9frontall.ko" loopback_dir="$loopdir" \
+			loopback_tag="$tag" || exit 1
+	fi
+fi
+tag=${tag:-p9}
+
+# msize the mount at $1 really got: the client shows it in /proc/mounts on
+# newer kernels; otherwise the xen transport lowers it to the device's
+# max_msize in debugfs (see p9_xen_create), found by the device's tag
+effective_msize() {
+	m=$(awk -v mnt="$1" '$2 == mnt { print $4 }' /proc/mounts |
+		tr , '\n' | sed -n 's/^msize=//p')
+	if [ -z "$m" ] && [ "$trans" = xen ]; then
+		m=$2
+		dev=$tag
+		for f in /sys/bus/xen/devices/*/mount_tag; do
+			[ -r "$f" ] && [ "$(cat "$f")" = "$tag" ] &&
+				dev=$(basename "$(dirname "$f")") && break
+		done
+		max=$(sudo sed -n 's/^max_msize //p' \
+			"/sys/kernel/debug/p9front/$dev/stats" 2>/dev/null)
+		[ -n "$max" ] && [ "$max" -gt 0 ] && [ "$max" -lt "$m" ] &&
+			m=$max
+	fi
+	echo "${m:-$2}"
+}
+
+report=$(mktemp) || exit 1
+trap 'sudo umount "$mnt" 2>/dev/null; rmdir "$mnt" 2>/dev/null; rm -f "$report"' EXIT
+mkdir -p "$mnt" || exit 1
+
+for msize in $(echo "$msizes" | tr , ' '); do
+	echo "p9bench: $trans msize=$msize" >&2
+	sudo mount -t 9p -o trans="$trans",version=9p2000.L,msize="$msize" \
+		"$tag" "$mnt" || exit 1
+	used=$(effective_msize "$mnt" "$msize")
+	[ "$used" = "$msize" ] ||
+		echo "p9bench: msize=$msize lowered to $used" >&2
+	sudo mkdir -p "$mnt/p9bench.$$" &&
+	sudo "$here/p9bench" -d "$mnt/p9bench.$$" -x transport="$trans" \
+		-x msize="$used" -x requested_msize="$msize" "$@" >> "$report"
+	rc=$?
+	sudo rmdir "$mnt/p9bench.$$"
+	sudo umount "$mnt"
+	[ $rc -eq 0 ] || exit $rc
+done
+
+# one JSON array of the result lines
+{
+	echo "["
+	sed '$!s/$/,/' "$report"
+	echo "]"
+} > "${out:-/dev/stdout}"
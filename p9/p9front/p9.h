@@ -103,14 +103,72 @@
  *      The maximum supported size of the request ring buffer in units of
  *      machine pages.  The value must be a power of 2.
  *
+ * multi-queue-max-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *
+ *      The maximum number of rings (queues), each with its own event
+ *      channel, the backend is willing to service for this device.
+ *
+ * feature-max-indirect-segments
+ *      Values:         <uint32_t>
+ *      Default Value:  0
+ *
+ *      The maximum number of segments the backend accepts in an indirect
+ *      request (nr_segments == P9_SEGMENTS_INDIRECT).  0 means indirect
+ *      requests are not supported, so a message and its reply must fit in
+ *      one data page and zero copy payloads in P9_MAX_SEGMENTS_PER_REQUEST
+ *      pages.
+ *
+ * max-data-ring-page-order
+ *      Values:         <uint32_t>
+ *      Default Value:  none (data rings not supported)
+ *
+ *      The largest data rings the backend can map, in units of lb(machine
+ *      pages), if it supports them (see Data rings below).
+ *
  *------------------------- Backend Device Properties -------------------------
  *
+ * feature-persistent
+ *      Values:         0/1 (boolean)
+ *      Default Value:  0
+ *      Notes:          7
  *
+ *      A value of "1" indicates that the backend can keep the grants used
+ *      by the frontend driver mapped, so the same set of grants should be
+ *      used in all transactions. The maximum number of grants the backend
+ *      can map persistently depends on the implementation, but ideally it
+ *      should be RING_SIZE.  If the backend doesn't persistently map all
+ *      the grants, it will have to unmap and map them on every request.
+ *
+ * multipath-session
+ *      Values:         string
+ *      Default Value:  none
+ *
+ *      An opaque identifier of the 9P session the backend serves for this
+ *      device.  Devices whose backends publish the same value share one
+ *      session, so fids attached through one of them are valid on all of
+ *      them and the frontend may spread a mount's requests over them
+ *      ("multipath" mount option).  Without this node a device is never
+ *      used as a path of another.
  *
  *****************************************************************************
  *                            Frontend XenBus Nodes
  *****************************************************************************
  *
+ * data-ring-page-order
+ *      Values:         <uint32_t>
+ *
+ *      Written only if the frontend uses data rings: the size of each of
+ *      them in units of lb(machine pages), at most max-data-ring-page-order.
+ *
+ * data-out-ref%u, data-in-ref%u
+ *      Values:         <uint32_t>
+ *
+ *      Grant references of the pages of the out and in data rings of a
+ *      queue, in order, in the device node or its queue-N subdirectory
+ *      next to ring-ref.
+ *
  *----------------------- Request Transport Parameters -----------------------
  *
  * event-channel
@@ -155,6 +213,34 @@
  *      The size of the frontend allocated request ring buffer in units of
  *      machine pages.  The value must be a power of 2.
  *
+ * multi-queue-num-queues
+ *      Values:         <uint32_t>
+ *      Default Value:  1
+ *      Maximum Value:  multi-queue-max-queues
+ *
+ *      The number of rings the frontend set up.  When this is greater than
+ *      1, ring-ref, ring-ref%u and event-channel are not written in the
+ *      device directory but in one "queue-%u" subdirectory per ring
+ *      (e.g. device/p9/0/queue-3/event-channel).  ring-page-order stays in
+ *      the device directory and applies to every ring.
+ *
+ * feature-persistent
+ *      Values:         0/1 (boolean)
+ *      Default Value:  0
+ *      Notes:          7
+ *
+ *      A value of "1" indicates that the frontend will reuse the same grants
+ *      for all transactions, allowing the backend to map them with write
+ *      access (even when it should be read-only).  The frontend keeps one
+ *      data page per ring slot in a pool and only grants it once per
+ *      connection.
+ *
+ *------------------------- Notes -------------------------
+ *
+ * (7) When both sides advertise "feature-persistent", the data page named
+ *     by p9_request.gref stays granted (and may stay mapped in the backend)
+ *     until the frontend disconnects.  A backend must therefore not assume
+ *     a gref is only valid for the lifetime of the request carrying it.
  */
  
 /*
@@ -249,23 +335,83 @@
 
 
 /*
- *  When we have multiple page ops.
+ * Maximum number of zero copy segments carried directly in a request.
+ * 11 keeps sizeof(struct p9_request) at 120 bytes, i.e. 32 slots in a
+ * single page ring.
+ */
+#define P9_MAX_SEGMENTS_PER_REQUEST 11
+
+/*
+ *  zero copy payload: one page of the client's buffer
+ *
+ *  @gref    grant reference to the page
+ *  @offset  offset in the page where the payload starts
+ *  @nrbytes number of bytes to transfer to/from this page
+ */
 struct p9_request_segment {
-    grant_ref_t    gref;        // grant ref to data        
-    uint32_t       nrbytes;     // number of bytes to transfer    
+        grant_ref_t    gref;
+        uint16_t       offset;
+        uint16_t       nrbytes;
 };
-*/
+
+/*
+ * Indirect requests.  A request whose nr_segments is P9_SEGMENTS_INDIRECT
+ * carries no data page (gref, offset and nrbytes are unused) and no
+ * segments of its own.  Instead, indirect.indirect_grefs name up to
+ * P9_MAX_INDIRECT_PAGES_PER_REQUEST pages, each an array of
+ * P9_SEGS_PER_INDIRECT_FRAME struct p9_request_segment, holding
+ * indirect.nr_segments segments in order:
+ *
+ *   segments [0, indirect.nr_out_segments) are read by the backend: the
+ *       out_len bytes of the message, then any zero copy out payload;
+ *   the remaining segments are written by the backend: the first in_len
+ *       bytes of the reply, then any zero copy in payload.
+ *
+ * The number of segments a backend accepts is advertised in
+ * feature-max-indirect-segments.
+ */
+#define P9_SEGMENTS_INDIRECT 0xff
+#define P9_MAX_INDIRECT_PAGES_PER_REQUEST 8
+#define P9_SEGS_PER_INDIRECT_FRAME \
+        (PAGE_SIZE / sizeof(struct p9_request_segment))
+
+struct p9_request_indirect {
+        uint16_t       nr_segments;
+        uint16_t       nr_out_segments;
+        grant_ref_t    indirect_grefs[P9_MAX_INDIRECT_PAGES_PER_REQUEST];
+};
+
+/*
+ * Data rings.  Each queue may have a pair of byte rings, granted once when
+ * the queue is set up: the out ring, which the backend only reads, and the
+ * in ring, which it writes.  A direct request whose gref is
+ * P9_DATA_RING_REF carries no data page.  Its message is instead the
+ * out_len bytes at byte offset of the out ring, and the room for its reply
+ * is the in_len bytes at byte nrbytes of the in ring.  Neither wraps past
+ * the end of its ring.  Zero copy segments are used as in any direct
+ * request.
+ */
+#define P9_DATA_RING_REF 0xffffffffU
+
 /*
  *  request for 9p transport front_end
  *
  *  @id  integer identifier
- *  @gref reference to the I/O buffer frame
- *  @offset offset in page where request starts
- *  @nr_bytes total number of bytes allocated to this request's data
+ *  @gref reference to the I/O buffer frame, or P9_DATA_RING_REF
+ *  @offset offset in page where request starts, or in the out data ring
+ *  @nr_bytes total number of bytes allocated to this request's data, or
+ *           where the reply goes in the in data ring
  *  @metadata_len - number of bytes of information about the request
  *  @out_len number of bytes of data being sent (may be 0)
  *  @in_len  number of bytes of data that may be returned
  *  @tag identifies the request to client on return
+ *  @nr_segments number of zero copy segments in @seg (may be 0), or
+ *           P9_SEGMENTS_INDIRECT for an indirect request (see above)
+ *  @nr_out_segments the first nr_out_segments of @seg hold payload that
+ *           follows the out_len bytes of the message; the rest receive
+ *           payload that follows the first in_len bytes of the reply
+ *           (e.g. the data of an Rread after its 11 byte header)
+ *  @seg zero copy segments; pages named here are granted per request
  *  
  */
 
@@ -277,6 +423,12 @@ struct p9_request {
         uint32_t       out_len;
         uint32_t       in_len;
         uint16_t       tag;  
+        uint8_t        nr_segments;
+        uint8_t        nr_out_segments;
+        union {
+                struct p9_request_segment seg[P9_MAX_SEGMENTS_PER_REQUEST];
+                struct p9_request_indirect indirect;
+        };
 };
 
 /*
@@ -298,6 +450,10 @@ enum p9_state {
     P9_STATE_SUSPENDED,
 };
 
+/*
+ * slots in a single page ring; a ring negotiated through ring-page-order
+ * holds RING_SIZE() slots instead.
+ */
 #define P9_RING_SIZE __CONST_RING_SIZE(p9, PAGE_SIZE)
 
 DEFINE_RING_TYPES(p9, struct p9_request, struct p9_response);
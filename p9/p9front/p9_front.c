@@ -45,6 +45,19 @@
 #include <linux/scatterlist.h>
 #include <linux/bitmap.h>
 #include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/llist.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/srcu.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include <xen/xen.h>
 #include <xen/xenbus.h>
@@ -62,192 +75,1637 @@
 #include <net/9p/client.h>
 #include <net/9p/transport.h>
 #include "p9.h"
+#include "p9_ring.h"
+#include "p9_pack.h"
 #include "xen_9p_front.h"
 
-#define GRANT_INVALID_REF 0
+#define CREATE_TRACE_POINTS
+#include "p9front_trace.h"
 
+#define GRANT_INVALID_REF 0
+#define RINGREF_NAME_LEN (20)
+/*
+ * number of maximal indirect requests the pool has pages for at once, on
+ * top of one page per ring slot
+ */
+#define P9_INDIRECT_RESERVE 2
+/*
+ * pool pages indirect requests leave for direct ones, on top of
+ * P9_FLUSH_RESERVE
+ */
+#define P9_DIRECT_RESERVE 8
+/*
+ * most responses p9_complete handles before letting other work run
+ */
+#define P9_COMPLETION_BUDGET 64
 /*
- * list of free and used ids
+ * request ids of each queue, and pool pages, only Tflush may take, so an
+ * interrupted requester can always flush its request, however busy the
+ * ring and however drained the pool
  */
-static int used_id[PAGE_SIZE];
+#define P9_FLUSH_RESERVE 2
 
 static DEFINE_MUTEX(p9front_mutex);
 
-static int  get_id_from_freelist (void)
+static unsigned int xen_p9_max_ring_order = P9_MAX_RING_PAGE_ORDER;
+module_param_named(max_ring_page_order, xen_p9_max_ring_order, uint, S_IRUGO);
+MODULE_PARM_DESC(max_ring_page_order, "Maximum order of pages to be used for the shared ring");
+
+static unsigned int xen_p9_max_queues = 4;
+module_param_named(max_queues, xen_p9_max_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(max_queues, "Maximum number of rings (queues) per 9p device");
+
+static unsigned int xen_p9_max_indirect_segments = 256;
+module_param_named(max_indirect_segments, xen_p9_max_indirect_segments, uint,
+		   S_IRUGO);
+MODULE_PARM_DESC(max_indirect_segments, "Maximum number of segments in an indirect request");
+
+static bool xen_p9_data_rings = true;
+module_param_named(data_rings, xen_p9_data_rings, bool, S_IRUGO);
+MODULE_PARM_DESC(data_rings, "Carry messages and replies in data rings shared for good, when the backend supports them");
+
+static unsigned int xen_p9_max_data_ring_order = P9_MAX_DATA_RING_PAGE_ORDER;
+module_param_named(max_data_ring_page_order, xen_p9_max_data_ring_order,
+		   uint, S_IRUGO);
+MODULE_PARM_DESC(max_data_ring_page_order, "Maximum order of pages to be used for each data ring");
+
+/*
+ * Request ids index the shadow array of a queue, see P9_FREELIST_* in
+ * p9_ring.h.  Both are called with ring_lock held.
+ */
+static int get_id_from_freelist(struct p9_front_queue *queue)
+{
+	/* -ENOSPC: every slot of the ring has a request in flight */
+	int id = P9_FREELIST_GET(queue->shadow, RING_SIZE(&queue->ring),
+				 &queue->shadow_free);
+
+	if (id >= 0) {
+		queue->nr_inflight++;
+		atomic_inc(&queue->info->inflight);
+	}
+	return id;
+}
+
+static int add_id_to_freelist(struct p9_front_queue *queue, unsigned long id)
 {
-	int i;
+	if (queue->shadow[id].req.id != id)
+		return -EINVAL;
+	P9_FREELIST_PUT(queue->shadow, &queue->shadow_free, id);
+	queue->nr_inflight--;
+	atomic_dec(&queue->info->inflight);
+	return 0;
+}
 
-	for (i=0; i<PAGE_SIZE; i++) 
-		if (!used_id[i])
-			return i;
-	return -1;
+static void init_freelist(struct p9_front_queue *queue)
+{
+	P9_FREELIST_INIT(queue->shadow, RING_SIZE(&queue->ring),
+			 &queue->shadow_free);
+	queue->nr_inflight = 0;
 }
 
-static void init_freelist (void)
+/*
+ * p9_grant_page - grant the backend access to a page, returning the gref
+ *                 or a negative errno
+ *
+ * A loopback device (p9_loop.c) has no other domain to grant to; its
+ * backend looks the page up by gref in its own table instead.
+ */
+static int p9_grant_page(struct p9_front_queue *queue, unsigned long pfn,
+			 int readonly)
 {
-	int i;
+	struct p9_front_info *info = queue->info;
 
-	for (i=0; i<PAGE_SIZE; i++) 
-		used_id[i] = false;
+	if (info->loop)
+		return p9_loop_grant(info->loop, pfn);
+	return gnttab_grant_foreign_access(info->xbdev->otherend_id,
+					   pfn_to_mfn(pfn), readonly);
 }
 
-static struct grant *get_grant(unsigned long pfn,
-			       struct p9_front_info *info)
+static void p9_end_grant(struct p9_front_queue *queue, grant_ref_t gref)
+{
+	if (queue->info->loop)
+		p9_loop_end_grant(queue->info->loop, gref);
+	else
+		gnttab_end_foreign_access(gref, 0, 0UL);
+}
+
+/*
+ * p9_try_end_grant - revoke a grant the backend may still be using
+ *
+ * Returns false, leaving the page granted, if the backend has it mapped or
+ * is copying to or from it; p9_end_grant would only defer the revocation
+ * then.  Once this returns true the backend cannot reach the page.
+ */
+static bool p9_try_end_grant(struct p9_front_queue *queue, grant_ref_t gref)
+{
+	if (queue->info->loop) {
+		/* the loopback backend copies under the lock this takes */
+		p9_loop_end_grant(queue->info->loop, gref);
+		return true;
+	}
+	if (!gnttab_end_foreign_access_ref(gref, 0))
+		return false;
+	gnttab_free_grant_reference(gref);
+	return true;
+}
+
+/*
+ * free_grant_buffer - revoke and release every page left in the pool
+ */
+static void free_grant_buffer(struct p9_front_queue *queue)
+{
+	struct grant *gnt_list_entry, *n;
+
+	list_for_each_entry_safe(gnt_list_entry, n, &queue->grants, node) {
+		list_del(&gnt_list_entry->node);
+		if (gnt_list_entry->gref != GRANT_INVALID_REF) {
+			p9_end_grant(queue, gnt_list_entry->gref);
+			queue->persistent_gnts_c--;
+		}
+		__free_page(pfn_to_page(gnt_list_entry->pfn));
+		kfree(gnt_list_entry);
+	}
+	BUG_ON(queue->persistent_gnts_c != 0);
+	queue->nr_free = 0;
+	queue->stats.pool_pages = 0;
+}
+
+/*
+ * p9_alloc_queue_pages - 2^@order pages of lowmem on the node of @queue
+ *
+ * Freed with free_pages, like __get_free_pages memory.
+ */
+static void *p9_alloc_queue_pages(struct p9_front_queue *queue, gfp_t gfp,
+				  unsigned int order)
+{
+	struct page *page = alloc_pages_node(queue->node, gfp, order);
+
+	return page ? page_address(page) : NULL;
+}
+
+/*
+ * fill_grant_buffer - populate the pool of data pages
+ *
+ * @queue - the queue whose pool is filled
+ * @num  - number of pages to add
+ *
+ * When the backend supports persistent grants the pages are granted here,
+ * once, so no grant operation is left on the request path.
+ */
+static int fill_grant_buffer(struct p9_front_queue *queue, int num)
 {
 	struct grant *gnt_list_entry;
-	unsigned long buffer_mfn;
+	struct page *granted_page;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		gnt_list_entry = kzalloc_node(sizeof(struct grant), GFP_NOIO,
+					      queue->node);
+		if (!gnt_list_entry)
+			goto out_of_memory;
+		granted_page = alloc_pages_node(queue->node, GFP_NOIO, 0);
+		if (!granted_page) {
+			kfree(gnt_list_entry);
+			goto out_of_memory;
+		}
+		gnt_list_entry->pfn = page_to_pfn(granted_page);
+		gnt_list_entry->gref = GRANT_INVALID_REF;
+		if (queue->info->feature_persistent) {
+			int ref = p9_grant_page(queue, gnt_list_entry->pfn, 0);
+			if (ref < 0) {
+				__free_page(granted_page);
+				kfree(gnt_list_entry);
+				goto out_of_memory;
+			}
+			gnt_list_entry->gref = ref;
+			queue->persistent_gnts_c++;
+		}
+		list_add(&gnt_list_entry->node, &queue->grants);
+		queue->nr_free++;
+		queue->stats.pool_pages++;
+	}
+	return 0;
 
-	gnt_list_entry = kzalloc(sizeof(struct grant), GFP_NOIO);
-	if (!gnt_list_entry)
-		goto out_of_memory;
+      out_of_memory:
+	printk(KERN_INFO "exiting fill_grant_buffer error ENOMEM\n");
+	free_grant_buffer(queue);
+	return -ENOMEM;
+}
+
+/*
+ * get_grant - take a data page from the pool; caller holds ring_lock
+ *
+ * Pages already granted (persistent grants) are handed out as is; otherwise
+ * the page is granted for the lifetime of this one request.
+ */
+static struct grant *get_grant(struct p9_front_queue *queue)
+{
+	struct grant *gnt_list_entry;
+	int ref;
 
-	gnt_list_entry->pfn = pfn;
+	if (list_empty(&queue->grants))
+		return ERR_PTR(-ENOSPC);
+	gnt_list_entry = list_first_entry(&queue->grants, struct grant, node);
+	list_del(&gnt_list_entry->node);
+	queue->nr_free--;
 
-	buffer_mfn = pfn_to_mfn(pfn);
+	if (gnt_list_entry->gref != GRANT_INVALID_REF) {
+		queue->persistent_gnts_c--;
+		return gnt_list_entry;
+	}
 
 	/* Assign a gref to this page */
-	gnt_list_entry->gref =
-	    gnttab_grant_foreign_access(info->xbdev->otherend_id,
-					buffer_mfn, 0);
+	ref = p9_grant_page(queue, gnt_list_entry->pfn, 0);
+	if (ref < 0) {
+		list_add(&gnt_list_entry->node, &queue->grants);
+		queue->nr_free++;
+		return ERR_PTR(ref);
+	}
+	gnt_list_entry->gref = ref;
 	return gnt_list_entry;
-      out_of_memory:
-	printk(KERN_INFO "exiting get_grant error ENOMEM\n");
-	///FIX MEMEMEMME
-	return (void *) -ENOMEM;
+}
+
+/*
+ * put_grant - return a data page to the pool once the backend is done
+ *             with it; caller holds ring_lock
+ */
+static void put_grant(struct p9_front_queue *queue, struct grant *gnt)
+{
+	if (queue->info->feature_persistent) {
+		queue->persistent_gnts_c++;
+	} else {
+		p9_end_grant(queue, gnt->gref);
+		gnt->gref = GRANT_INVALID_REF;
+	}
+	list_add(&gnt->node, &queue->grants);
+	queue->nr_free++;
+}
+
+/*
+ * put_grants - return every page on @list to the pool; caller holds ring_lock
+ */
+static void put_grants(struct p9_front_queue *queue, struct list_head *list)
+{
+	struct grant *gnt, *n;
+
+	list_for_each_entry_safe(gnt, n, list, node) {
+		list_del(&gnt->node);
+		put_grant(queue, gnt);
+	}
+}
+
+/*
+ * get_grants - take @num data pages from the pool onto the tail of @list,
+ *              all of them or none; caller holds ring_lock
+ *
+ * Used for indirect requests, which may not take the last
+ * P9_DIRECT_RESERVE pages: those are kept for direct requests, so small
+ * RPCs still make progress while large ones have the pool drained.  Nor
+ * the P9_FLUSH_RESERVE pages below them, kept for Tflush.
+ */
+static int get_grants(struct p9_front_queue *queue, struct list_head *list,
+		      unsigned int num)
+{
+	struct grant *gnt;
+
+	if (queue->nr_free < num + P9_DIRECT_RESERVE + P9_FLUSH_RESERVE)
+		return -ENOSPC;
+	while (num--) {
+		gnt = get_grant(queue);
+		if (IS_ERR(gnt)) {
+			put_grants(queue, list);
+			return PTR_ERR(gnt);
+		}
+		list_add_tail(&gnt->node, list);
+	}
+	return 0;
+}
+
+/*
+ * get_slot - take a slot of at least @size bytes for a direct request;
+ *            caller holds ring_lock
+ *
+ * Direct requests share pool pages: a page is carved into slots of one
+ * size class, P9_MIN_SLOT << class bytes, and goes back to the pool once
+ * all of its slots are free again.  Pages with free slots are kept on
+ * the class's slot_pages list.  A new page is not carved from the last
+ * @reserve pages of the pool.
+ */
+static int get_slot(struct p9_front_queue *queue, struct p9_shadow *shadow,
+		    unsigned int size, unsigned int reserve)
+{
+	unsigned int class = p9_slot_class(size);
+	struct grant *gnt;
+
+	BUILD_BUG_ON(PAGE_SIZE / P9_MIN_SLOT > BITS_PER_LONG);
+	if (list_empty(&queue->slot_pages[class])) {
+		if (queue->nr_free <= reserve)
+			return -ENOSPC;
+		gnt = get_grant(queue);
+		if (IS_ERR(gnt))
+			return PTR_ERR(gnt);
+		gnt->slot_class = class;
+		gnt->slot_free = P9_SLOTS_MASK(class);
+		list_add(&gnt->node, &queue->slot_pages[class]);
+	}
+	gnt = list_first_entry(&queue->slot_pages[class], struct grant, node);
+	shadow->slot = gnt;
+	shadow->slot_offset = p9_slot_take(&gnt->slot_free, class);
+	if (!gnt->slot_free)
+		list_del(&gnt->node);
+	queue->stats.slots[class]++;
+	return 0;
+}
+
+/*
+ * put_slot - free the slot of a direct request; caller holds ring_lock
+ */
+static void put_slot(struct p9_front_queue *queue, struct p9_shadow *shadow)
+{
+	struct grant *gnt = shadow->slot;
+	unsigned int class = gnt->slot_class;
+
+	if (!gnt->slot_free)
+		list_add(&gnt->node, &queue->slot_pages[class]);
+	if (p9_slot_put(&gnt->slot_free, class, shadow->slot_offset)) {
+		list_del(&gnt->node);
+		put_grant(queue, gnt);
+	}
+	queue->stats.slots[class]--;
+	shadow->slot = NULL;
+}
+
+/*
+ * p9_data_ring_get - take a span of @len bytes of a data ring, returning
+ *                    its offset or -ENOSPC; caller holds ring_lock
+ */
+static int p9_data_ring_get(struct p9_data_ring *dr, unsigned int len)
+{
+	return p9_data_span_get(&dr->prod, dr->cons, dr->size, len);
+}
+
+/*
+ * get_data_ring - take the spans of the data rings for the message and
+ *                 the reply of a direct request; caller holds ring_lock
+ */
+static int get_data_ring(struct p9_front_queue *queue,
+			 struct p9_shadow *shadow, unsigned int out_len,
+			 unsigned int in_len)
+{
+	unsigned int mask = RING_SIZE(&queue->ring) - 1;
+	u32 out_prod = queue->data_out.prod;
+	struct p9_data_span *span;
+	int out_off, in_off;
+
+	/* the oldest request still holds its spans: no entry left */
+	if (queue->span_head - queue->span_tail > mask)
+		return -ENOSPC;
+	out_off = p9_data_ring_get(&queue->data_out, out_len);
+	if (out_off < 0)
+		return out_off;
+	in_off = p9_data_ring_get(&queue->data_in, in_len);
+	if (in_off < 0) {
+		queue->data_out.prod = out_prod;
+		return in_off;
+	}
+	span = &queue->spans[queue->span_head & mask];
+	span->out_end = queue->data_out.prod;
+	span->in_end = queue->data_in.prod;
+	span->done = false;
+	shadow->span = queue->span_head++;
+	shadow->data_ring = true;
+	p9_pack_direct(&shadow->req, P9_DATA_RING_REF, out_off, in_off);
+	return 0;
+}
+
+/*
+ * put_data_ring - give back the data ring spans of a request, and of any
+ *                 later ones done before it; caller holds ring_lock
+ */
+static void put_data_ring(struct p9_front_queue *queue,
+			  struct p9_shadow *shadow)
+{
+	p9_data_spans_put(queue->spans, RING_SIZE(&queue->ring) - 1,
+			  shadow->span, &queue->span_tail, queue->span_head,
+			  &queue->data_out.cons, &queue->data_in.cons);
+	shadow->data_ring = false;
+}
+
+/*
+ * put_request_data - give back the data pages, slot or data ring spans of
+ *                    a request; caller holds ring_lock
+ */
+static void put_request_data(struct p9_front_queue *queue,
+			     struct p9_shadow *shadow)
+{
+	put_grants(queue, &shadow->grants);
+	if (shadow->slot)
+		put_slot(queue, shadow);
+	if (shadow->data_ring)
+		put_data_ring(queue, shadow);
+}
+
+/*
+ * p9_free_data_ring - revoke the grants of a data ring and free it
+ */
+static void p9_free_data_ring(struct p9_front_queue *queue,
+			      struct p9_data_ring *dr)
+{
+	unsigned int i;
+
+	if (!dr->buf)
+		return;
+	for (i = 0; i < dr->size / PAGE_SIZE; i++)
+		if (dr->ref[i] != GRANT_INVALID_REF)
+			p9_end_grant(queue, dr->ref[i]);
+	free_pages((unsigned long) dr->buf, get_order(dr->size));
+	dr->buf = NULL;
+}
+
+/*
+ * p9_init_data_ring - allocate a data ring and grant its pages, read only
+ *                     for the out ring
+ */
+static int p9_init_data_ring(struct p9_front_queue *queue,
+			     struct p9_data_ring *dr, int readonly)
+{
+	unsigned int i, nr_pages = queue->info->nr_data_ring_pages;
+	int ref;
+
+	dr->size = nr_pages * PAGE_SIZE;
+	dr->prod = dr->cons = 0;
+	for (i = 0; i < nr_pages; i++)
+		dr->ref[i] = GRANT_INVALID_REF;
+	dr->buf = p9_alloc_queue_pages(queue, GFP_NOIO | __GFP_ZERO,
+				       get_order(dr->size));
+	if (!dr->buf)
+		return -ENOMEM;
+	for (i = 0; i < nr_pages; i++) {
+		ref = p9_grant_page(queue,
+				    page_to_pfn(virt_to_page(dr->buf +
+							 i * PAGE_SIZE)),
+				    readonly);
+		if (ref < 0)
+			return ref;
+		dr->ref[i] = ref;
+	}
+	return 0;
+}
+
+/*
+ * p9front_data_ring_fits - whether a request goes through the data rings:
+ *                          they are in use, the message and the reply each
+ *                          take at most half of its ring, and the zero copy
+ *                          pages fit in the request itself
+ */
+int p9front_data_ring_fits(struct p9_front_info *info, unsigned int out_len,
+			   unsigned int in_len, unsigned int nr_zc_segs)
+{
+	return p9_data_ring_fits(info->nr_data_ring_pages * PAGE_SIZE,
+				 out_len, in_len, nr_zc_segs);
+}
+
+/*
+ * p9_free_queue - release the ring, event channel and data pages of a queue
+ */
+static void p9_free_queue(struct p9_front_queue *queue)
+{
+	struct p9_front_info *info = queue->info;
+	unsigned int i;
+
+	spin_lock_irq(&queue->ring_lock);
+	free_grant_buffer(queue);
+	spin_unlock_irq(&queue->ring_lock);
+
+	/* Free resources associated with old device channel. */
+	for (i = 0; i < info->nr_ring_pages; i++) {
+		if (queue->ring_ref[i] != GRANT_INVALID_REF) {
+			gnttab_end_foreign_access(queue->ring_ref[i], 0, 0UL);
+			queue->ring_ref[i] = GRANT_INVALID_REF;
+		}
+	}
+	if (queue->ring.sring) {
+		free_pages((unsigned long) queue->ring.sring,
+			   get_order(info->nr_ring_pages * PAGE_SIZE));
+		queue->ring.sring = NULL;
+	}
+	if (queue->irq) {
+		irq_set_affinity_hint(queue->irq, NULL);
+		unbind_from_irqhandler(queue->irq, queue);
+	}
+	queue->evtchn = queue->irq = 0;
+	tasklet_kill(&queue->tasklet);
+	p9_free_data_ring(queue, &queue->data_out);
+	p9_free_data_ring(queue, &queue->data_in);
+	kfree(queue->spans);
+	queue->spans = NULL;
+	kfree(queue->shadow);
+	queue->shadow = NULL;
+}
+
+/*
+ * shadow_seg - segment @n of a request: in the request itself, or in
+ *              its indirect pages
+ */
+static struct p9_request_segment *shadow_seg(struct p9_shadow *shadow,
+					     unsigned int n)
+{
+	struct p9_request_segment *segs;
+
+	if (shadow->req.nr_segments != P9_SEGMENTS_INDIRECT)
+		return &shadow->req.seg[n];
+	segs = pfn_to_kaddr(shadow->indirect[n / P9_SEGS_PER_INDIRECT_FRAME]->pfn);
+	return &segs[n % P9_SEGS_PER_INDIRECT_FRAME];
+}
+
+/*
+ * end_zc_segments - revoke the grants of @nr_segs zero copy segments,
+ *                   starting at segment @first
+ */
+static void end_zc_segments(struct p9_front_queue *queue,
+			    struct p9_shadow *shadow, unsigned int first,
+			    unsigned int nr_segs)
+{
+	unsigned int i;
+	grant_ref_t gref;
+
+	/* p9_revoke_reply may have revoked some already */
+	for (i = 0; i < nr_segs; i++) {
+		gref = shadow_seg(shadow, first + i)->gref;
+		if (gref != GRANT_INVALID_REF)
+			p9_end_grant(queue, gref);
+	}
+}
+
+/*
+ * p9_revoke_reply - take back the zero copy reply pages of a request being
+ *                   cancelled, when they are not pinned user pages
+ *
+ * Those are rc->sdata granted in place (see p9_xen_fcall_pages) or a
+ * kernel buffer, which the 9p client frees or hands to the next user of
+ * the tag as soon as the request is flushed.  Returns false if the backend
+ * is still using one of them: the request must then be left to complete.
+ * The pages revoked so far stay revoked, so the backend fails to write the
+ * reply and answers with an error.  Called with ring_lock held.
+ */
+static bool p9_revoke_reply(struct p9_front_queue *queue,
+			    struct p9_shadow *shadow)
+{
+	struct p9_request_segment *seg;
+	unsigned int i, first = shadow->nr_out_segs + shadow->nr_reply_segs;
+
+	if (!shadow->zc_in.pages || shadow->zc_pinned)
+		return true;
+	for (i = first; i < shadow->nr_segs; i++) {
+		seg = shadow_seg(shadow, i);
+		if (seg->gref == GRANT_INVALID_REF)
+			continue;
+		if (!p9_try_end_grant(queue, seg->gref))
+			return false;
+		seg->gref = GRANT_INVALID_REF;
+	}
+	return true;
+}
+
+/*
+ * grant_zc_segments - grant the pages of a zero copy payload to the backend
+ *
+ * @first - first segment to fill in
+ * @zc  - the payload, may be NULL
+ * @readonly - the backend only reads the payload (out direction)
+ *
+ * Returns the number of segments filled in, or a negative errno with no
+ * grant left behind.
+ */
+static int grant_zc_segments(struct p9_front_queue *queue,
+			     struct p9_shadow *shadow, unsigned int first,
+			     struct p9_zc_payload *zc, int readonly)
+{
+	struct p9_request_segment *seg;
+	unsigned int offset, len, nrbytes;
+	int i, ref;
+
+	if (!zc)
+		return 0;
+	offset = zc->offset;
+	len = zc->len;
+	for (i = 0; i < zc->nr_pages && len; i++) {
+		ref = p9_grant_page(queue, page_to_pfn(zc->pages[i]), readonly);
+		if (ref < 0) {
+			end_zc_segments(queue, shadow, first, i);
+			return ref;
+		}
+		nrbytes = min_t(unsigned int, len, PAGE_SIZE - offset);
+		seg = shadow_seg(shadow, first + i);
+		seg->gref = ref;
+		seg->offset = offset;
+		seg->nrbytes = nrbytes;
+		len -= nrbytes;
+		offset = 0;
+	}
+	return i;
+}
+
+/*
+ * add_data_segments - describe @len bytes of pool pages as segments
+ *
+ * @n    - first segment to fill in
+ * @gnt  - in: the first page to use; out: the page after the last one used
+ * @data - bytes to copy into the pages, NULL for pages the reply goes in
+ *
+ * Returns the segment after the last one filled in.
+ */
+static unsigned int add_data_segments(struct p9_shadow *shadow, unsigned int n,
+				      struct grant **gnt, const char *data,
+				      unsigned int len)
+{
+	unsigned int nrbytes;
+
+	while (len) {
+		nrbytes = p9_pack_page(shadow_seg(shadow, n++), (*gnt)->gref,
+				       pfn_to_kaddr((*gnt)->pfn), data, len);
+		if (data)
+			data += nrbytes;
+		len -= nrbytes;
+		*gnt = list_entry((*gnt)->node.next, struct grant, node);
+	}
+	return n;
+}
+
+/*
+ * copy_reply - copy the reply out of the data pages into the 9p request
+ *
+ * The reply starts with its own size; copy no more than that.  In an
+ * indirect request the reply pages follow the message pages.
+ */
+static void copy_reply(struct p9_front_queue *queue, struct p9_shadow *shadow)
+{
+	struct grant *gnt;
+	unsigned int len, nrbytes, i;
+	char *src, *dst = shadow->in_data;
+
+	if (shadow->data_ring) {
+		src = queue->data_in.buf + shadow->req.nrbytes;
+		len = p9_reply_len(src, shadow->req.in_len);
+		memcpy(dst, src, len);
+		shadow->reply_len = len;
+		return;
+	}
+	if (shadow->req.nr_segments != P9_SEGMENTS_INDIRECT) {
+		src = (char *) pfn_to_kaddr(shadow->slot->pfn) +
+		      shadow->slot_offset + shadow->req.out_len;
+		len = p9_reply_len(src, shadow->req.in_len);
+		memcpy(dst, src, len);
+		shadow->reply_len = len;
+		return;
+	}
+	gnt = list_first_entry(&shadow->grants, struct grant, node);
+	for (i = 0; i < shadow->nr_msg_segs; i++)
+		gnt = list_entry(gnt->node.next, struct grant, node);
+	src = (char *) pfn_to_kaddr(gnt->pfn);
+	len = p9_reply_len(src, shadow->req.in_len);
+	shadow->reply_len = len;
+	while (len) {
+		nrbytes = min_t(unsigned int, len, PAGE_SIZE);
+		memcpy(dst, pfn_to_kaddr(gnt->pfn), nrbytes);
+		dst += nrbytes;
+		len -= nrbytes;
+		gnt = list_entry(gnt->node.next, struct grant, node);
+	}
+}
+
+static void p9_release_zc(struct p9_zc_payload *zc, int pinned)
+{
+	if (zc->pages)
+		p9_xen_zc_release(zc->pages, zc->nr_pages, pinned);
+	zc->pages = NULL;
+}
+
+/*
+ * p9_save_inflight - take the requests still in flight off a queue whose
+ *                    ring is about to be freed
+ *
+ * Their grants are revoked and their pages go back to the pool.  A request
+ * is added to info->replay if there is room, otherwise it fails with EIO.
+ * Cancelled requests are just dropped.  The queue's irq and tasklet are
+ * stopped and p9_free has waited for pollers to leave the queue, so no
+ * response can come in meanwhile and none is still being handed over.
+ * Called with p9front_mutex held.
+ */
+static void p9_save_inflight(struct p9_front_queue *queue, unsigned int room)
+{
+	struct p9_front_info *info = queue->info;
+	struct p9_shadow *shadow;
+	struct p9_replay *r;
+	unsigned long id;
+
+	spin_lock_irq(&queue->ring_lock);
+	for (id = 0; id < RING_SIZE(&queue->ring); id++) {
+		shadow = &queue->shadow[id];
+		if (shadow->req.id != id)
+			continue;
+		end_zc_segments(queue, shadow, shadow->nr_msg_segs,
+				shadow->nr_out_segs - shadow->nr_msg_segs);
+		end_zc_segments(queue, shadow,
+				shadow->nr_out_segs + shadow->nr_reply_segs,
+				shadow->nr_segs - shadow->nr_out_segs -
+				shadow->nr_reply_segs);
+		queue->stats.zc_grants -= shadow->nr_segs -
+			shadow->nr_msg_segs - shadow->nr_reply_segs;
+		if (!shadow->cancelled && info->nr_replay < room) {
+			r = &info->replay[info->nr_replay++];
+			r->queue = queue->id;
+			r->tag = shadow->req.tag;
+			r->out_data = shadow->out_data;
+			r->out_len = shadow->req.out_len;
+			r->in_data = shadow->in_data;
+			r->in_len = shadow->req.in_len;
+			r->zc_out = shadow->zc_out;
+			r->zc_in = shadow->zc_in;
+			r->zc_pinned = shadow->zc_pinned;
+			r->queued = shadow->t_queued;
+			r->pushed = shadow->t_pushed;
+			r->dropped = false;
+		} else {
+			p9_release_zc(&shadow->zc_out, shadow->zc_pinned);
+			p9_release_zc(&shadow->zc_in, shadow->zc_pinned);
+			if (!shadow->cancelled)
+				p9_xen_req_error(info->chan, shadow->req.tag,
+						 shadow->in_data, EIO);
+		}
+		if (shadow->cancelled)
+			queue->stats.cancelled_inflight--;
+		put_request_data(queue, shadow);
+		add_id_to_freelist(queue, id);
+	}
+	spin_unlock_irq(&queue->ring_lock);
+}
+
+/*
+ * p9_fail_replay - fail the requests waiting to be replayed with EIO; the
+ *                  device is going away for good.  Called with
+ *                  p9front_mutex held.
+ */
+static void p9_fail_replay(struct p9_front_info *info)
+{
+	struct p9_replay *r;
+	unsigned int i;
+
+	for (i = 0; i < info->nr_replay; i++) {
+		r = &info->replay[i];
+		if (r->dropped)
+			continue;
+		p9_release_zc(&r->zc_out, r->zc_pinned);
+		p9_release_zc(&r->zc_in, r->zc_pinned);
+		p9_xen_req_error(info->chan, r->tag, r->in_data, EIO);
+	}
+	kfree(info->replay);
+	info->replay = NULL;
+	info->nr_replay = 0;
+}
+
+/*
+ * p9_grow_replay - make room in info->replay for every request that can
+ *                  be in flight, on top of those already waiting there;
+ *                  returns that room
+ */
+static unsigned int p9_grow_replay(struct p9_front_info *info)
+{
+	struct p9_replay *replay;
+	unsigned int i, room = info->nr_replay;
+
+	for (i = 0; i < info->nr_queues; i++)
+		room += RING_SIZE(&info->queues[i].ring);
+	replay = kcalloc(room, sizeof(*replay), GFP_NOIO);
+	if (!replay)
+		return info->nr_replay;
+	if (info->nr_replay)
+		memcpy(replay, info->replay,
+		       info->nr_replay * sizeof(*replay));
+	kfree(info->replay);
+	info->replay = replay;
+	return room;
 }
 
 /*
  * called whenever it's necessary to free up resources:  suspend/resume, exiting
+ *
+ * @suspend - the device is expected to reconnect: requests in flight are
+ *            kept in info->replay for p9front_connect to submit again.
+ *            Otherwise they, and any still waiting to be replayed, fail
+ *            with EIO.
  */
 void p9_free(struct p9_front_info *info, int suspend)
 {
+	struct p9_front_queue *queue;
+	unsigned int i, room = 0;
+
 	printk(KERN_INFO "free");
 	/* Prevent new requests being issued until we fix things up. */
 	spin_lock_irq(&info->io_lock);
 	info->connected = suspend ?
 	    P9_STATE_SUSPENDED : P9_STATE_DISCONNECTED;
+	info->is_ready = 0;
 	spin_unlock_irq(&info->io_lock);
+	/*
+	 * submitters waiting for room go and wait for the device instead,
+	 * and a replay waiting for room stops
+	 */
+	if (info->chan->vc_wq)
+		wake_up_all(info->chan->vc_wq);
+	flush_work(&info->replay_work);
+	/* keep the stats file off the queues while they are torn down */
+	mutex_lock(&p9front_mutex);
+	/* and those already on a queue are done with it */
+	synchronize_srcu(&info->srcu);
 
-	/* Free resources associated with old device channel. */
-	if (info->ring_ref != GRANT_INVALID_REF) {
-		gnttab_end_foreign_access(info->ring_ref, 0,
-					  (unsigned long) info->ring.
-					  sring);
-		info->ring_ref = GRANT_INVALID_REF;
-		info->ring.sring = NULL;
-	}
-	if (info->irq)
-		unbind_from_irqhandler(info->irq, info);
-	info->evtchn = info->irq = 0;
+	if (suspend)
+		room = p9_grow_replay(info);
+	else
+		p9_fail_replay(info);
+	for (i = 0; i < info->nr_queues; i++) {
+		queue = &info->queues[i];
+		/* no more responses: what is still in flight is ours */
+		if (queue->irq) {
+			irq_set_affinity_hint(queue->irq, NULL);
+			unbind_from_irqhandler(queue->irq, queue);
+		}
+		queue->irq = 0;
+		tasklet_kill(&queue->tasklet);
+		if (queue->shadow)
+			p9_save_inflight(queue, room);
+		p9_free_queue(queue);
+	}
+	kfree(info->queue_map);
+	info->queue_map = NULL;
+	kfree(info->queues);
+	info->queues = NULL;
+	info->nr_queues = 0;
+	mutex_unlock(&p9front_mutex);
 	printk(KERN_INFO "exiting\n");
 }
+static void p9front_replay_work(struct work_struct *work);
+
 /*
- * p9_handle_response:  get request corresponding to response
- *                      pass this info + data to req_done in trans_xen9p.c
+ * p9front_init_info - set up what a device's info needs before it can be
+ *                     registered, for p9_xen_probe and the loopback
+ *                     backend; @chan is the device's channel
  *
- *  @bret -  the response struct
- *  @info -  per device information including the array of past requests
+ * The info starts with the device's reference; p9front_put frees it, the
+ * channel and its tag once the last mount using the channel is closed.
+ */
+int p9front_init_info(struct p9_front_info *info, struct xen9p_chan *chan)
+{
+	int err;
+
+	err = init_srcu_struct(&info->srcu);
+	if (err)
+		return err;
+	spin_lock_init(&info->io_lock);
+	kref_init(&info->kref);
+	INIT_WORK(&info->replay_work, p9front_replay_work);
+	info->connected = P9_STATE_DISCONNECTED;
+	info->chan = chan;
+	chan->drv_info = info;
+	return 0;
+}
+
+void p9front_get(struct p9_front_info *info)
+{
+	kref_get(&info->kref);
+}
+
+static void p9front_release(struct kref *kref)
+{
+	struct p9_front_info *info = container_of(kref, struct p9_front_info,
+						  kref);
+	struct xen9p_chan *chan = info->chan;
+
+	cleanup_srcu_struct(&info->srcu);
+	vfree(info->latency);
+	kfree(info);
+	kfree(chan->vc_wq);
+	kfree(chan->session);
+	kfree(chan->tag);
+	kfree(chan);
+}
+
+void p9front_put(struct p9_front_info *info)
+{
+	kref_put(&info->kref, p9front_release);
+}
+
+/*
+ * p9front_remove - the device is going away for good
  *
+ * Tears the rings down, failing what is in flight with EIO, and wakes the
+ * submitters waiting for the device so they fail too.  A mount still
+ * using the channel keeps the info until it is closed; requests it makes
+ * meanwhile fail with EIO.  Drops the device's reference.
  */
-void p9_handle_response(struct p9_response *bret,
-			       struct p9_front_info *info)
+void p9front_remove(struct p9_front_info *info)
 {
-	unsigned long id;
-	void *addr;
+	spin_lock_irq(&info->io_lock);
+	info->removed = true;
+	spin_unlock_irq(&info->io_lock);
+	p9_free(info, 0);
+	p9front_put(info);
+}
 
-	id = bret->id;
-	printk("in handle_response; id is %lu\n", id);
-	used_id[id] = false;
-	addr = &(info->addresses[id]);
-	req_done (addr, info->chan, bret->status, bret->tag);
+/*
+ * p9_record_latency - count the time a request spent in one phase in the
+ *                     histogram for its type
+ *
+ * Bucket n counts latencies of [2^(n-1), 2^n) microseconds; bucket 0 those
+ * under a microsecond, the last one everything longer.
+ */
+static void p9_record_latency(struct p9_front_info *info, u8 type,
+			      enum p9_lat_phase phase, ktime_t from, ktime_t to)
+{
+	s64 us;
+	unsigned int bucket;
+
+	if (!info->latency)
+		return;
+	us = ktime_us_delta(to, from);
+	bucket = us > 0 ? min_t(unsigned int, fls64(us), P9_LAT_BUCKETS - 1) : 0;
+	atomic_long_inc(&info->latency->hist[P9_LAT_TYPE(type)][phase][bucket]);
 }
 
-static irqreturn_t p9_interrupt(int irq, void *dev_id)
+static int p9front_latency_show(struct seq_file *m, void *v)
+{
+	static const char * const phase_name[P9_LAT_NR] = {
+		"queue", "service", "complete",
+	};
+	struct p9_front_info *info = m->private;
+	unsigned int t, p, b, last;
+	long count;
+
+	seq_puts(m, "# type phase: requests per bucket; bucket n is [2^(n-1), 2^n) us\n");
+	for (t = 0; t < P9_LAT_NR_TYPES; t++) {
+		for (p = 0; p < P9_LAT_NR; p++) {
+			last = P9_LAT_BUCKETS;
+			for (b = 0; b < P9_LAT_BUCKETS; b++)
+				if (atomic_long_read(&info->latency->hist[t][p][b]))
+					last = b;
+			if (last == P9_LAT_BUCKETS)
+				continue;
+			seq_printf(m, "%3u %-8s", t << 1, phase_name[p]);
+			for (b = 0; b <= last; b++) {
+				count = atomic_long_read(&info->latency->hist[t][p][b]);
+				seq_printf(m, " %ld", count);
+			}
+			seq_putc(m, '\n');
+		}
+	}
+	return 0;
+}
+
+static int p9front_latency_open(struct inode *inode, struct file *file)
 {
+	return single_open(file, p9front_latency_show, inode->i_private);
+}
+
+static const struct file_operations p9front_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = p9front_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char * const p9_state_name[] = {
+	[P9_STATE_DISCONNECTED] = "disconnected",
+	[P9_STATE_CONNECTED] = "connected",
+	[P9_STATE_SUSPENDED] = "suspended",
+};
+
+/*
+ * p9front_stats_show - one "name value" line per counter, the per queue
+ *                      ones prefixed with qN_, for monitoring to scrape
+ */
+static int p9front_stats_show(struct seq_file *m, void *v)
+{
+	struct p9_front_info *info = m->private;
+	struct p9_front_queue *queue;
+	struct p9_queue_stats stats;
+	unsigned int i, c, cpu, inflight, ring_size, nr_free, persistent;
+	unsigned long flags;
+
+	mutex_lock(&p9front_mutex);
+	seq_printf(m, "state %s\n", p9_state_name[info->connected]);
+	if (info->connected != P9_STATE_CONNECTED) {
+		mutex_unlock(&p9front_mutex);
+		return 0;
+	}
+	seq_printf(m, "nr_queues %u\n", info->nr_queues);
+	seq_printf(m, "ring_pages %u\n", info->nr_ring_pages);
+	seq_printf(m, "feature_persistent %u\n", info->feature_persistent);
+	seq_printf(m, "max_indirect_segments %u\n",
+		   info->max_indirect_segments);
+	seq_printf(m, "max_msize %u\n", info->max_msize);
+	seq_printf(m, "data_ring_pages %u\n", info->nr_data_ring_pages);
+	for_each_online_cpu(cpu)
+		seq_printf(m, "cpu%u_queue %u\n", cpu, info->queue_map[cpu]);
+	for (i = 0; i < info->nr_queues; i++) {
+		queue = &info->queues[i];
+		spin_lock_irqsave(&queue->ring_lock, flags);
+		stats = queue->stats;
+		ring_size = RING_SIZE(&queue->ring);
+		inflight = queue->ring.req_prod_pvt - queue->ring.rsp_cons;
+		nr_free = queue->nr_free;
+		persistent = queue->persistent_gnts_c;
+		spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+		seq_printf(m, "q%u_node %d\n", i, queue->node);
+		seq_printf(m, "q%u_ring_size %u\n", i, ring_size);
+		seq_printf(m, "q%u_inflight %u\n", i, inflight);
+		seq_printf(m, "q%u_inflight_max %u\n", i, stats.inflight_max);
+		seq_printf(m, "q%u_requests %lu\n", i, stats.requests);
+		seq_printf(m, "q%u_responses %lu\n", i, stats.responses);
+		seq_printf(m, "q%u_indirect %lu\n", i, stats.indirect);
+		seq_printf(m, "q%u_data_ring %lu\n", i, stats.data_ring);
+		seq_printf(m, "q%u_data_ring_full %lu\n", i,
+			   stats.data_ring_full);
+		seq_printf(m, "q%u_out_bytes %llu\n", i, stats.out_bytes);
+		seq_printf(m, "q%u_in_bytes %llu\n", i, stats.in_bytes);
+		seq_printf(m, "q%u_pool_pages %u\n", i, stats.pool_pages);
+		seq_printf(m, "q%u_pool_free %u\n", i, nr_free);
+		seq_printf(m, "q%u_pool_granted_free %u\n", i, persistent);
+		seq_printf(m, "q%u_zc_grants %lu\n", i, stats.zc_grants);
+		for (c = 0; c < P9_NR_SLOT_CLASSES; c++)
+			seq_printf(m, "q%u_slots_%u %u\n", i,
+				   P9_MIN_SLOT << c, stats.slots[c]);
+		seq_printf(m, "q%u_notify %lu\n", i, stats.notify);
+		seq_printf(m, "q%u_notify_suppressed %lu\n", i,
+			   stats.notify_suppressed);
+		seq_printf(m, "q%u_interrupts %lu\n", i, stats.interrupts);
+		seq_printf(m, "q%u_ring_full %lu\n", i, stats.ring_full);
+		seq_printf(m, "q%u_batches %lu\n", i, stats.batches);
+		seq_printf(m, "q%u_batch_max %u\n", i, stats.batch_max);
+		seq_printf(m, "q%u_cancelled %lu\n", i, stats.cancelled);
+		seq_printf(m, "q%u_cancelled_inflight %u\n", i,
+			   stats.cancelled_inflight);
+	}
+	mutex_unlock(&p9front_mutex);
+	return 0;
+}
 
+static int p9front_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, p9front_stats_show, inode->i_private);
+}
+
+static const struct file_operations p9front_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = p9front_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *p9front_debugfs_root;
+
+void p9front_debugfs_register(void)
+{
+	p9front_debugfs_root = debugfs_create_dir("p9front", NULL);
+}
+
+void p9front_debugfs_unregister(void)
+{
+	debugfs_remove_recursive(p9front_debugfs_root);
+	p9front_debugfs_root = NULL;
+}
+
+/*
+ * p9front_debugfs_add - create p9front/<device>/ in debugfs, with the
+ *                       counters and latency histograms of the device
+ */
+void p9front_debugfs_add(struct p9_front_info *info)
+{
+	if (!p9front_debugfs_root)
+		return;
+	info->debugfs = debugfs_create_dir(info->xbdev ?
+					   dev_name(&info->xbdev->dev) :
+					   info->chan->tag,
+					   p9front_debugfs_root);
+	if (IS_ERR_OR_NULL(info->debugfs)) {
+		info->debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("stats", S_IRUGO, info->debugfs, info,
+			    &p9front_stats_fops);
+	if (info->latency)
+		debugfs_create_file("latency", S_IRUSR, info->debugfs, info,
+				    &p9front_latency_fops);
+}
+
+void p9front_debugfs_remove(struct p9_front_info *info)
+{
+	debugfs_remove_recursive(info->debugfs);
+	info->debugfs = NULL;
+}
+
+/*
+ * p9_handle_response:  get request corresponding to response
+ *                      copy the reply into it and tell req_done in
+ *                      trans_xen9p.c
+ *
+ *  @shadow - the request; shadow->rsp holds its response
+ *  @queue - the queue the response arrived on
+ *
+ * Called from p9_complete without ring_lock: the request id is not
+ * returned to the free list until afterwards, so nothing else touches
+ * the shadow entry or its pages meanwhile.
+ *
+ */
+void p9_handle_response(struct p9_shadow *shadow,
+			struct p9_front_queue *queue)
+{
+
+	/*
+	 * the backend is done with the zero copy pages: revoke them and let
+	 * trans_xen9p.c unpin them before the requester is woken up
+	 */
+	end_zc_segments(queue, shadow, shadow->nr_msg_segs,
+			shadow->nr_out_segs - shadow->nr_msg_segs);
+	end_zc_segments(queue, shadow,
+			shadow->nr_out_segs + shadow->nr_reply_segs,
+			shadow->nr_segs - shadow->nr_out_segs -
+			shadow->nr_reply_segs);
+	if (shadow->zc_out.pages)
+		p9_xen_zc_release(shadow->zc_out.pages,
+				  shadow->zc_out.nr_pages, shadow->zc_pinned);
+	if (shadow->zc_in.pages)
+		p9_xen_zc_release(shadow->zc_in.pages,
+				  shadow->zc_in.nr_pages, shadow->zc_pinned);
+	/* nobody waits for the reply of a cancelled request any more */
+	if (shadow->cancelled)
+		return;
+	/*
+	 * the backend could not read the request or write the reply: what
+	 * is in the reply buffer is not a 9p message
+	 */
+	if (shadow->rsp.status != P9_RSP_OKAY) {
+		shadow->reply_len = 0;
+		p9_xen_req_error(queue->info->chan, shadow->rsp.tag,
+				 shadow->in_data, EIO);
+	} else {
+		copy_reply(queue, shadow);
+		req_done (queue->info->chan, shadow->rsp.status,
+			  shadow->rsp.tag);
+	}
+	p9_record_latency(queue->info, shadow->type, P9_LAT_COMPLETE,
+			  shadow->t_consumed, ktime_get());
+	trace_p9front_client_cb(queue->id, shadow->rsp.tag, shadow->type,
+				ktime_us_delta(ktime_get(), shadow->t_queued));
+}
+
+/*
+ * p9_complete - completion tasklet of a queue
+ *
+ * Takes up to P9_COMPLETION_BUDGET responses off the ring under ring_lock,
+ * then copies the replies and wakes the requesters with the lock dropped
+ * and interrupts on.  If responses are left over the tasklet reschedules
+ * itself rather than hold the CPU until the ring is empty.
+ */
+static void p9_complete(unsigned long data)
+{
+	struct p9_front_queue *queue = (struct p9_front_queue *) data;
+	unsigned long ids[P9_COMPLETION_BUDGET];
 	struct p9_response *bret;
 	RING_IDX i, rp;
-	unsigned long flags;
-	struct p9_front_info *info = (struct p9_front_info *) dev_id;
+	unsigned long flags, id;
+	int n = 0, k, more_to_do = 0;
+	ktime_t now = ktime_get();
+	struct p9_shadow *shadow;
 
-	printk(KERN_INFO "interrupt\n");
-	spin_lock_irqsave(&info->io_lock, flags);
+	spin_lock_irqsave(&queue->ring_lock, flags);
+	rp = p9_ring_rsp_prod(&queue->ring);
 
-      again:
-	rp = info->ring.sring->rsp_prod;
-	rmb();			/* Ensure we see queued responses up to 'rp'. */
+	for (i = queue->ring.rsp_cons; i != rp && n < P9_COMPLETION_BUDGET;
+	     i++) {
+		bret = RING_GET_RESPONSE(&queue->ring, i);
+		id = bret->id;
+		if (id >= RING_SIZE(&queue->ring) ||
+		    queue->shadow[id].req.id != id) {
+			printk(KERN_WARNING
+			       "p9front: response has incorrect id (%lu)\n", id);
+			continue;
+		}
+		/* the ring slot is reused once rsp_cons moves past it */
+		shadow = &queue->shadow[id];
+		shadow->rsp = *bret;
+		/* from here on p9front_cancel leaves the request be */
+		shadow->completing = true;
+		shadow->t_consumed = now;
+		p9_record_latency(queue->info, shadow->type, P9_LAT_SERVICE,
+				  shadow->t_pushed, now);
+		trace_p9front_response(queue->id, i, id, bret->tag,
+				       bret->status,
+				       ktime_us_delta(now, shadow->t_pushed));
+		ids[n++] = id;
+	}
+
+// moving consumer ring pointer; i stops short of rp when out of budget
+	more_to_do = p9_ring_finish_responses(&queue->ring, i, rp);
+	spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+	for (k = 0; k < n; k++)
+		p9_handle_response(&queue->shadow[ids[k]], queue);
+
+	spin_lock_irqsave(&queue->ring_lock, flags);
+	for (k = 0; k < n; k++) {
+		shadow = &queue->shadow[ids[k]];
+		queue->stats.responses++;
+		queue->stats.in_bytes += shadow->reply_len + shadow->zc_in.len;
+		queue->stats.zc_grants -= shadow->nr_segs -
+			shadow->nr_msg_segs - shadow->nr_reply_segs;
+		if (shadow->cancelled)
+			queue->stats.cancelled_inflight--;
+		put_request_data(queue, shadow);
+		add_id_to_freelist(queue, ids[k]);
+	}
+	/* slots and data pages were freed: let blocked submitters retry */
+	if (n && !queue->ring_bufs_avail) {
+		queue->ring_bufs_avail = 1;
+		wake_up(queue->info->chan->vc_wq);
+	}
+	spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+	if (more_to_do)
+		tasklet_schedule(&queue->tasklet);
+}
+
+/*
+ * p9front_poll - take the responses waiting on @queue, from a task polling
+ *                for its reply
+ *
+ * Runs the same completion as the tasklet.  The two may race; each only
+ * handles the responses it took off the ring under ring_lock.  Returns
+ * nonzero if there were any.  The caller holds the device's SRCU read
+ * side, which keeps p9_free from freeing @queue.
+ */
+int p9front_poll(struct p9_front_queue *queue)
+{
+	if (!RING_HAS_UNCONSUMED_RESPONSES(&queue->ring))
+		return 0;
+	p9_complete((unsigned long) queue);
+	return 1;
+}
+
+/*
+ * p9front_event - the backend has queued responses; leave them to the
+ *                 queue's tasklet.  Called from p9_interrupt, or directly
+ *                 by the loopback backend.
+ */
+void p9front_event(struct p9_front_queue *queue)
+{
+	queue->stats.interrupts++;
+	trace_p9front_interrupt(queue->id, queue->ring.sring->rsp_prod,
+				queue->ring.rsp_cons);
+	tasklet_schedule(&queue->tasklet);
+}
+
+/*
+ * p9front_cancel - give up on the request with 9p tag @tag
+ *
+ * The 9p client is about to flush the request, after which it reuses the
+ * tag and the reply buffer.  The request stays on its ring until the
+ * backend answers it; marked cancelled, its response only gives back the
+ * id, the data pages and the grants (see p9_handle_response).
+ *
+ * Reply pages granted in place that are not pinned user pages are revoked
+ * first, see p9_revoke_reply.
+ *
+ * Returns 1 if the request was with the backend and is now cancelled, 0
+ * if no request with @tag is in flight, or -EINPROGRESS if its response
+ * was already taken off the ring and is being handed to the client, or
+ * the backend is still writing to its reply pages: the caller then waits
+ * for the response.
+ */
+int p9front_cancel(struct p9_front_info *info, u16 tag)
+{
+	struct p9_front_queue *queue;
+	struct p9_shadow *shadow;
+	unsigned long flags, id;
+	unsigned int i;
+	int ret = 0;
+
+	/* the queues go away in p9_free under p9front_mutex */
+	mutex_lock(&p9front_mutex);
+	/* not on a ring while the device reconnects: just do not replay it */
+	for (i = 0; i < info->nr_replay; i++) {
+		struct p9_replay *r = &info->replay[i];
+
+		if (r->dropped || r->tag != tag)
+			continue;
+		r->dropped = true;
+		p9_release_zc(&r->zc_out, r->zc_pinned);
+		p9_release_zc(&r->zc_in, r->zc_pinned);
+		mutex_unlock(&p9front_mutex);
+		return 0;
+	}
+	for (i = 0; i < info->nr_queues && !ret; i++) {
+		queue = &info->queues[i];
+		spin_lock_irqsave(&queue->ring_lock, flags);
+		for (id = 0; id < RING_SIZE(&queue->ring); id++) {
+			shadow = &queue->shadow[id];
+			/* an earlier request with this tag may be cancelled */
+			if (shadow->req.id != id || shadow->req.tag != tag ||
+			    shadow->cancelled)
+				continue;
+			if (shadow->completing ||
+			    !p9_revoke_reply(queue, shadow)) {
+				ret = -EINPROGRESS;
+			} else {
+				shadow->cancelled = true;
+				queue->stats.cancelled++;
+				queue->stats.cancelled_inflight++;
+				ret = 1;
+			}
+			break;
+		}
+		spin_unlock_irqrestore(&queue->ring_lock, flags);
+	}
+	mutex_unlock(&p9front_mutex);
+	return ret;
+}
+
+/*
+ * p9front_ring_avail - whether a submitter that got -ENOSPC from queue @id
+ *                      can try again: the queue has room, or the device is
+ *                      disconnected and the queue may be gone
+ */
+int p9front_ring_avail(struct p9_front_info *info, unsigned int id)
+{
+	int idx, ret;
+
+	/* p9_free frees the queues once the state has changed */
+	idx = srcu_read_lock(&info->srcu);
+	ret = info->connected != P9_STATE_CONNECTED || !info->is_ready ||
+	      id >= info->nr_queues || info->queues[id].ring_bufs_avail;
+	srcu_read_unlock(&info->srcu, idx);
+	return ret;
+}
+
+static irqreturn_t p9_interrupt(int irq, void *dev_id)
+{
+	p9front_event((struct p9_front_queue *) dev_id);
+	return IRQ_HANDLED;
+}
+
+/*
+ * p9_init_ring - allocate and initialise the ring and the shadow requests
+ *                of a queue, not yet shared with the backend
+ */
+static int p9_init_ring(struct p9_front_queue *queue)
+{
+	struct p9_sring *sring;
+	unsigned long ring_size = queue->info->nr_ring_pages * PAGE_SIZE;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < queue->info->nr_ring_pages; i++)
+		queue->ring_ref[i] = GRANT_INVALID_REF;
+	sring = p9_alloc_queue_pages(queue, GFP_NOIO | __GFP_HIGH,
+				     get_order(ring_size));
+	if (!sring)
+		return -ENOMEM;
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&queue->ring, sring, ring_size);
+
+	/* one shadow entry, and so one request id, per ring slot */
+	queue->shadow = kzalloc_node(RING_SIZE(&queue->ring) *
+				     sizeof(struct p9_shadow), GFP_NOIO,
+				     queue->node);
+	if (!queue->shadow)
+		return -ENOMEM;
+	init_freelist(queue);
+
+	if (!queue->info->nr_data_ring_pages)
+		return 0;
+	queue->spans = kzalloc_node(RING_SIZE(&queue->ring) *
+				    sizeof(struct p9_data_span), GFP_NOIO,
+				    queue->node);
+	if (!queue->spans)
+		return -ENOMEM;
+	queue->span_head = queue->span_tail = 0;
+	err = p9_init_data_ring(queue, &queue->data_out, 1);
+	if (!err)
+		err = p9_init_data_ring(queue, &queue->data_in, 0);
+	return err;
+}
+
+/*
+ * setup_9p_ring - call RING macros to initalize xen ring
+ *
+ * @dev - the device information
+ * @queue - the queue to set up; info->nr_ring_pages is the negotiated size
+ *
+ */
+static int setup_9p_ring(struct xenbus_device *dev,
+			 struct p9_front_queue *queue)
+{
+	struct p9_sring *sring;
+	unsigned int i;
+	int err;
+
+	err = p9_init_ring(queue);
+	if (err) {
+		xenbus_dev_fatal(dev, err, "allocating shared ring");
+		goto fail;
+	}
+	sring = queue->ring.sring;
+	for (i = 0; i < queue->info->nr_ring_pages; i++) {
+		err = xenbus_grant_ring(dev, virt_to_mfn((char *) sring +
+							 i * PAGE_SIZE));
+		if (err < 0)
+			goto fail;
+		queue->ring_ref[i] = err;
+	}
+	err = xenbus_alloc_evtchn(dev, &queue->evtchn);
+	if (err)
+		goto fail;
+	if (queue->info->nr_queues == 1)
+		snprintf(queue->name, sizeof(queue->name), "p9");
+	else
+		snprintf(queue->name, sizeof(queue->name), "p9-q%u",
+			 queue->id);
+	err = bind_evtchn_to_irqhandler(queue->evtchn, p9_interrupt, 0,
+					queue->name, queue);
+	if (err <= 0) {
+		xenbus_dev_fatal(dev, err,
+				 "bind_evtchn_to_irqhandler failed");
+		goto fail;
+	}
+	queue->irq = err;
+	/* take the responses on the node the queue's memory is on */
+	if (queue->node != NUMA_NO_NODE)
+		irq_set_affinity_hint(queue->irq,
+				      cpumask_of_node(queue->node));
+	return 0;
+      fail:
+	printk(KERN_INFO "exiting setup_p9_ring at fail\n");
+	return err;
+}
+
+/*
+ * p9_alloc_queues - pick the number of queues and allocate them
+ *
+ * The backend advertises how many queues it can service in
+ * multi-queue-max-queues; use one per online vCPU, up to that and the
+ * max_queues module parameter.
+ */
+static int p9_init_queues(struct p9_front_info *info, unsigned int nr_queues);
+
+static int p9_alloc_queues(struct xenbus_device *dev,
+			   struct p9_front_info *info)
+{
+	unsigned int backend_max_queues, nr_queues;
+	int err;
+
+	err = xenbus_scanf(XBT_NIL, dev->otherend,
+			   "multi-queue-max-queues", "%u", &backend_max_queues);
+	if (err != 1)
+		backend_max_queues = 1;
+	nr_queues = min_t(unsigned int, backend_max_queues, xen_p9_max_queues);
+	nr_queues = min_t(unsigned int, nr_queues, num_online_cpus());
+	if (nr_queues == 0)
+		nr_queues = 1;
 
-	for (i = info->ring.rsp_cons; i != rp; i++) {
-		bret = RING_GET_RESPONSE(&info->ring, i);
-		p9_handle_response(bret, info);
-	}
+	err = p9_init_queues(info, nr_queues);
+	if (err)
+		xenbus_dev_fatal(dev, err, "allocating queues");
+	return err;
+}
 
-// moving consumer ring pointer
-	info->ring.rsp_cons = i;
+/*
+ * p9_map_queues - spread the vCPUs over the queues, node by node
+ *
+ * The online vCPUs, taken node after node, are cut into @nr_queues runs
+ * of consecutive vCPUs, so a queue is only shared by vCPUs of one node
+ * unless there are fewer queues than nodes.  Each queue is placed on the
+ * node of the first vCPU mapped to it; a vCPU brought online later stays
+ * on its index modulo the number of queues.
+ */
+static void p9_map_queues(struct p9_front_info *info)
+{
+	unsigned int cpu, node, q, k = 0;
+	unsigned int nr_cpus = num_online_cpus();
 
-	if (i != info->ring.req_prod_pvt) {
-		int more_to_do;
-		RING_FINAL_CHECK_FOR_RESPONSES(&info->ring, more_to_do);
-		if (more_to_do) {
-			//I shouldn't be here
-			printk(KERN_INFO
-			       "yikes i is %d; info->ring.req_prod_pvt is %d\n",
-			       i, info->ring.req_prod_pvt);
-			goto again;
+	for_each_possible_cpu(cpu)
+		info->queue_map[cpu] = cpu % info->nr_queues;
+	for (q = 0; q < info->nr_queues; q++)
+		info->queues[q].node = NUMA_NO_NODE;
+	for_each_online_node(node) {
+		for_each_cpu(cpu, cpumask_of_node(node)) {
+			if (!cpu_online(cpu))
+				continue;
+			q = min(k++ * info->nr_queues / nr_cpus,
+				info->nr_queues - 1);
+			info->queue_map[cpu] = q;
+			if (info->queues[q].node == NUMA_NO_NODE)
+				info->queues[q].node = node;
 		}
-	} else
-		info->ring.sring->rsp_event = i + 1;
+	}
+}
 
+/*
+ * p9_init_queues - allocate @nr_queues queues, with no ring yet
+ */
+static int p9_init_queues(struct p9_front_info *info, unsigned int nr_queues)
+{
+	unsigned int i, j;
 
-	spin_unlock_irqrestore(&info->io_lock, flags);
-	return IRQ_HANDLED;
+	info->queues = kcalloc(nr_queues, sizeof(struct p9_front_queue),
+			       GFP_KERNEL);
+	if (!info->queues)
+		return -ENOMEM;
+	info->queue_map = kcalloc(nr_cpu_ids, sizeof(*info->queue_map),
+				  GFP_KERNEL);
+	if (!info->queue_map) {
+		kfree(info->queues);
+		info->queues = NULL;
+		return -ENOMEM;
+	}
+	info->nr_queues = nr_queues;
+	p9_map_queues(info);
+	for (i = 0; i < nr_queues; i++) {
+		struct p9_front_queue *queue = &info->queues[i];
+
+		spin_lock_init(&queue->ring_lock);
+		INIT_LIST_HEAD(&queue->grants);
+		for (j = 0; j < P9_NR_SLOT_CLASSES; j++)
+			INIT_LIST_HEAD(&queue->slot_pages[j]);
+		queue->ring_bufs_avail = 1;
+		init_llist_head(&queue->pending);
+		tasklet_init(&queue->tasklet, p9_complete,
+			     (unsigned long) queue);
+		queue->id = i;
+		queue->info = info;
+	}
+	return 0;
 }
 
 /*
- * setup_9p_ring - call RING macros to initalize xen ring
- *
- * @dev - the device information
- * @info - the per instance info
+ * write_queue_nodes - publish the ring-ref(s) and event-channel of a queue
  *
+ * @path - the device node for a single queue, otherwise its queue-N subdir
  */
-static int setup_9p_ring(struct xenbus_device *dev,
-			 struct p9_front_info *info)
+static int write_queue_nodes(struct xenbus_transaction xbt,
+			     struct p9_front_queue *queue, const char *path,
+			     const char **message)
 {
-	struct p9_sring *sring;
+	unsigned int i;
 	int err;
 
-	info->ring_ref = GRANT_INVALID_REF;
-	sring = (struct p9_sring *) __get_free_page(GFP_NOIO | __GFP_HIGH);
-	if (!sring) {
-		xenbus_dev_fatal(dev, -ENOMEM, "allocating shared ring");
-		printk(KERN_INFO "exiting enomem\n");
-		return -ENOMEM;
+	if (queue->info->nr_ring_pages == 1) {
+		err = xenbus_printf(xbt, path,
+				    "ring-ref", "%u", queue->ring_ref[0]);
+		if (err) {
+			*message = "writing ring-ref";
+			return err;
+		}
+	} else {
+		for (i = 0; i < queue->info->nr_ring_pages; i++) {
+			char ring_ref_name[RINGREF_NAME_LEN];
+
+			snprintf(ring_ref_name, RINGREF_NAME_LEN,
+				 "ring-ref%u", i);
+			err = xenbus_printf(xbt, path,
+					    ring_ref_name, "%u",
+					    queue->ring_ref[i]);
+			if (err) {
+				*message = "writing ring-ref";
+				return err;
+			}
+		}
 	}
-	SHARED_RING_INIT(sring);
-	FRONT_RING_INIT(&info->ring, sring, PAGE_SIZE);
-	err = xenbus_grant_ring(dev, virt_to_mfn(info->ring.sring));
-	if (err < 0) {
-		free_page((unsigned long) sring);
-		info->ring.sring = NULL;
-		goto fail;
+	for (i = 0; i < queue->info->nr_data_ring_pages; i++) {
+		char ref_name[RINGREF_NAME_LEN];
+
+		snprintf(ref_name, RINGREF_NAME_LEN, "data-out-ref%u", i);
+		err = xenbus_printf(xbt, path, ref_name, "%u",
+				    queue->data_out.ref[i]);
+		if (!err) {
+			snprintf(ref_name, RINGREF_NAME_LEN,
+				 "data-in-ref%u", i);
+			err = xenbus_printf(xbt, path, ref_name, "%u",
+					    queue->data_in.ref[i]);
+		}
+		if (err) {
+			*message = "writing data ring refs";
+			return err;
+		}
 	}
-	info->ring_ref = err;
-	err = xenbus_alloc_evtchn(dev, &info->evtchn);
-	if (err)
-		goto fail;
-	err = bind_evtchn_to_irqhandler(info->evtchn, p9_interrupt, 0,
-					"p9", info);
-	if (err <= 0) {
-		xenbus_dev_fatal(dev, err,
-				 "bind_evtchn_to_irqhandler failed");
-		goto fail;
+	err = xenbus_printf(xbt, path,
+			    "event-channel", "%u", queue->evtchn);
+	if (err) {
+		*message = "writing event-channel";
+		return err;
 	}
-	info->irq = err;
 	return 0;
-      fail:
-	printk(KERN_INFO "exiting setup_p9_ring at fail\n");
-	p9_free(info, 0);
-	return err;
 }
 
 /* Common code used when first setting up, and when resuming. */
@@ -255,12 +1713,57 @@ int talk_to_9p_back(struct xenbus_device *dev, struct p9_front_info *info)
 {
 	const char *message = NULL;
 	struct xenbus_transaction xbt;
+	unsigned int max_page_order, ring_page_order = 0, data_ring_order = 0;
+	unsigned int i;
+	char *session;
 	int err;
 
-/* Create shared ring, alloc event channel. */
-	err = setup_9p_ring(dev, info);
+	/*
+	 * The backend advertises how big a ring it can map; use the largest
+	 * size both sides support.
+	 */
+	err = xenbus_scanf(XBT_NIL, dev->otherend,
+			   "max-ring-page-order", "%u", &max_page_order);
+	if (err == 1)
+		ring_page_order = min_t(unsigned int, max_page_order,
+					min_t(unsigned int,
+					      xen_p9_max_ring_order,
+					      P9_MAX_RING_PAGE_ORDER));
+	info->nr_ring_pages = 1 << ring_page_order;
+
+	/* and how big data rings, if it takes them */
+	info->nr_data_ring_pages = 0;
+	err = xenbus_scanf(XBT_NIL, dev->otherend,
+			   "max-data-ring-page-order", "%u", &max_page_order);
+	if (err == 1 && xen_p9_data_rings) {
+		data_ring_order = min_t(unsigned int, max_page_order,
+					min_t(unsigned int,
+					      xen_p9_max_data_ring_order,
+					      P9_MAX_DATA_RING_PAGE_ORDER));
+		info->nr_data_ring_pages = 1 << data_ring_order;
+	}
+
+	/* and how large a 9p message it takes, if it has a limit */
+	err = xenbus_scanf(XBT_NIL, dev->otherend,
+			   "max-request-size", "%u", &info->max_request_size);
+	if (err != 1)
+		info->max_request_size = 0;
+
+	/* and whether its 9P session is shared with other devices */
+	session = xenbus_read(XBT_NIL, dev->otherend, "multipath-session", NULL);
+	p9_xen_set_session(info->chan, IS_ERR(session) ? NULL : session);
+
+	/* Allocate one queue per vCPU, as many as the backend allows. */
+	err = p9_alloc_queues(dev, info);
 	if (err)
 		goto out;
+
+/* Create shared rings, alloc event channels. */
+	for (i = 0; i < info->nr_queues; i++) {
+		err = setup_9p_ring(dev, &info->queues[i]);
+		if (err)
+			goto destroy_p9ring;
+	}
       again:
 	err = xenbus_transaction_start(&xbt);
 	if (err) {
@@ -268,16 +1771,57 @@ int talk_to_9p_back(struct xenbus_device *dev, struct p9_front_info *info)
 		goto destroy_p9ring;
 	}
 
-	err = xenbus_printf(xbt, dev->nodename,
-			    "ring-ref", "%u", info->ring_ref);
-	if (err) {
-		message = "writing ring-ref";
-		goto abort_transaction;
+	if (info->nr_ring_pages > 1) {
+		err = xenbus_printf(xbt, dev->nodename,
+				    "ring-page-order", "%u", ring_page_order);
+		if (err) {
+			message = "writing ring-page-order";
+			goto abort_transaction;
+		}
+	}
+	if (info->nr_queues == 1) {
+		err = write_queue_nodes(xbt, &info->queues[0], dev->nodename,
+					&message);
+		if (err)
+			goto abort_transaction;
+	} else {
+		err = xenbus_printf(xbt, dev->nodename,
+				    "multi-queue-num-queues", "%u",
+				    info->nr_queues);
+		if (err) {
+			message = "writing multi-queue-num-queues";
+			goto abort_transaction;
+		}
+		for (i = 0; i < info->nr_queues; i++) {
+			char *path;
+
+			path = kasprintf(GFP_KERNEL, "%s/queue-%u",
+					 dev->nodename, i);
+			if (!path) {
+				err = -ENOMEM;
+				message = "ENOMEM while writing queue paths";
+				goto abort_transaction;
+			}
+			err = write_queue_nodes(xbt, &info->queues[i], path,
+						&message);
+			kfree(path);
+			if (err)
+				goto abort_transaction;
+		}
+	}
+	if (info->nr_data_ring_pages) {
+		err = xenbus_printf(xbt, dev->nodename,
+				    "data-ring-page-order", "%u",
+				    data_ring_order);
+		if (err) {
+			message = "writing data-ring-page-order";
+			goto abort_transaction;
+		}
 	}
 	err = xenbus_printf(xbt, dev->nodename,
-			    "event-channel", "%u", info->evtchn);
+			    "feature-persistent", "%u", 1);
 	if (err) {
-		message = "writing event-channel";
+		message = "writing feature-persistent";
 		goto abort_transaction;
 	}
 
@@ -309,90 +1853,742 @@ void p9front_closing(struct p9_front_info *info)
 {
 	struct xenbus_device *xbdev = info->xbdev;
 	printk(KERN_INFO "closing");
+	/*
+	 * the backend may come back: keep what is in flight for it.  The
+	 * rings are set up before it connects, so free them even if it
+	 * never did, or the next talk_to_9p_back leaks them.
+	 */
+	if (info->queues)
+		p9_free(info, 1);
 	xenbus_frontend_closed(xbdev);
 	printk(KERN_INFO "exiting\n");
 }
 
-int p9front_handle_client_request (struct p9_front_info *info,
-					uint16_t tag,
-					char *out_data, int out_len,
-					char *in_data, int in_len)
+/*
+ * flush_requests - publish the requests queued on the ring, and notify the
+ *                  backend only if it asked to be (req_event); caller
+ *                  holds ring_lock
+ */
+static inline void flush_requests(struct p9_front_queue *queue)
+{
+	int notify = p9_ring_push(&queue->ring);
+
+	trace_p9front_doorbell(queue->id, queue->ring.req_prod_pvt, notify);
+
+	if (notify) {
+		queue->stats.notify++;
+		if (queue->info->loop)
+			p9_loop_kick(queue->info->loop, queue->id);
+		else
+			notify_remote_via_irq(queue->irq);
+	} else {
+		queue->stats.notify_suppressed++;
+	}
+}
+
+/*
+ * p9front_plug - hold back the requests queued on @queue
+ *
+ * Requests put on a plugged queue are written to the ring but not pushed;
+ * p9front_unplug publishes them together with at most one notification.
+ * Plugs nest.  Nothing reaches the backend while the queue is plugged, so
+ * a caller must not wait for the reply to a request queued under its own
+ * plug.
+ */
+void p9front_plug(struct p9_front_queue *queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->ring_lock, flags);
+	queue->plugged++;
+	spin_unlock_irqrestore(&queue->ring_lock, flags);
+}
+
+void p9front_unplug(struct p9_front_queue *queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->ring_lock, flags);
+	if (!--queue->plugged &&
+	    queue->ring.req_prod_pvt != queue->ring.sring->req_prod)
+		flush_requests(queue);
+	spin_unlock_irqrestore(&queue->ring_lock, flags);
+}
+
+/*
+ * p9front_select_queue - pick the queue a request is submitted on
+ *
+ * Requests go out on the queue of the submitting vCPU, so vCPUs only
+ * share a ring and its locks when there are fewer queues than vCPUs,
+ * and then with vCPUs of their own node; see p9_map_queues.
+ */
+struct p9_front_queue *p9front_select_queue(struct p9_front_info *info)
+{
+	if (info->nr_queues <= 1)
+		return info->queues;
+	return &info->queues[info->queue_map[raw_smp_processor_id()]];
+}
+
+/*
+ * struct p9_submit - a request waiting on the submission list of a queue
+ * @node : link in the queue's pending list
+ * @err  : what putting it on the ring returned, once @done is completed
+ * @batch: set when @done is completed to hand the submitter the queue's
+ *         submit ownership, with the batch it is to drain; NULL when the
+ *         entry has just been put on the ring
+ * @done : completed by the queue's submit owner when it is finished with
+ *         the entry, which lives on the submitter's stack
+ *
+ * The other fields are the arguments of p9front_handle_client_request.
+ */
+struct p9_submit {
+	struct llist_node	node;
+	uint16_t		tag;
+	char			*out_data;
+	int			out_len;
+	char			*in_data;
+	int			in_len;
+	struct p9_zc_payload	*zc_out;
+	struct p9_zc_payload	*zc_in;
+	int			zc_pinned;
+	ktime_t			queued;
+	int			err;
+	struct llist_node	*batch;
+	struct completion	done;
+};
+
+/*
+ * __p9front_handle_client_request - put a 9p message on a ring
+ *
+ * Called with the queue's ring_lock held, from p9_drain_batch only; the
+ * request is written to the ring but not pushed.
+ *
+ * @out_data, @out_len - the message, copied into data pages
+ * @in_data, @in_len  - where the reply goes, and the room to leave for it
+ *            in the data pages
+ * @zc_out, @zc_in - optional zero copy payloads; their pages are granted
+ *            to the backend directly and the page arrays are owned by the
+ *            queue until the response arrives
+ * @zc_pinned - the zero copy pages are pinned user pages
+ * @queued  - when the 9p client handed the request to the transport
+ *
+ * Returns -ENOSPC when the ring, its request ids or its data pages are
+ * used up, the last P9_FLUSH_RESERVE ids and pool pages counting as used
+ * for anything but Tflush; ring_bufs_avail is then clear until a response
+ * frees some.  A Tflush is small enough for a slot, so with the data
+ * rings full it still finds a page.
+ *
+ * When the device has data rings, a message and reply that fit in them
+ * are copied to and from those, with no data page or grant involved,
+ * unless the rings are full: then they are laid out as without them.
+ * A message that fits in one data page together with its reply, with few
+ * enough zero copy pages for the request's own segments, goes out as is.
+ * Anything larger is described page by page in indirect segments, if the
+ * backend supports them.
+ */
+static int __p9front_handle_client_request(struct p9_front_queue *queue,
+					   uint16_t tag,
+					   char *out_data, int out_len,
+					   char *in_data, int in_len,
+					   struct p9_zc_payload *zc_out,
+					   struct p9_zc_payload *zc_in,
+					   int zc_pinned, ktime_t queued)
 {
+	struct p9_front_info *info = queue->info;
 	int err = 0;
-	struct page *apage;
-	char *addr;
-	int tot_sz;
 	p9_request_t *ring_req;
-	struct grant *gnt_list_entry = NULL;
-	int offset = 0;
+	struct p9_shadow *shadow;
+	struct grant *gnt_list_entry, *gnt;
+	grant_ref_t indirect_grefs[P9_MAX_INDIRECT_PAGES_PER_REQUEST];
+	struct p9_pack pack;
 	int id;
+	unsigned int nr_zc_segs, nr_msg_segs, nr_reply_segs;
+	unsigned int n, i, reserve;
+	int indirect, data_ring;
+	u8 type = out_len > 4 ? out_data[4] : 0;	/* size[4] type[1] */
+
+	nr_zc_segs = (zc_out ? zc_out->nr_pages : 0) +
+		     (zc_in ? zc_in->nr_pages : 0);
+	err = p9_pack_plan(&pack, out_len, in_len, nr_zc_segs,
+			   info->nr_data_ring_pages * PAGE_SIZE,
+			   info->max_indirect_segments);
+	if (err) {
+		printk ("request too large: out_len is %u, in_len is %u, %u zero copy pages",
+			out_len, in_len, nr_zc_segs);
+		return err;
+	}
+	data_ring = pack.kind == P9_PACK_DATA_RING;
+	indirect = pack.kind == P9_PACK_INDIRECT;
+	nr_msg_segs = pack.nr_msg_segs;
+	nr_reply_segs = pack.nr_reply_segs;
 
-	if (!info->is_ready) {
-		err = -1;  
-		/* wait */goto out;
-	}  
-	tot_sz = out_len + in_len;
-	if (tot_sz > PAGE_SIZE) {
-	  	printk ("request too large: out_len is %u and in_len is %u",
-			out_len, in_len);
+	reserve = type == P9_TFLUSH ? 0 : P9_FLUSH_RESERVE;
+	/* the rings are going away, or not there yet: wait for the device */
+	if (info->connected != P9_STATE_CONNECTED) {
+		err = -EAGAIN;
+		goto out;
+	}
+	if (RING_FULL(&queue->ring) ||
+	    queue->nr_inflight + reserve >= RING_SIZE(&queue->ring)) {
 		err = -ENOSPC;
 		goto out;
 	}
-	if (tot_sz + info->offset > PAGE_SIZE) {
-		apage = alloc_page(GFP_NOIO);
-		if (tot_sz < info->offset)	// just temporary
-			info->page = apage;
-		info->offset = 0;
-	} else {
-		apage = info->page;
-		offset = info->offset;
+	id = get_id_from_freelist(queue);
+	if (id < 0) {
+		err = id;
+		goto out;
+	}
+	shadow = &queue->shadow[id];
+	shadow->req.id = id;
+	INIT_LIST_HEAD(&shadow->grants);
+	if (data_ring) {
+		err = get_data_ring(queue, shadow, out_len, in_len);
+		/*
+		 * spans come back in submission order, so one long running
+		 * request holds up the rings; go through the pool meanwhile
+		 * rather than wait behind it
+		 */
+		if (err == -ENOSPC &&
+		    !p9_pack_plan(&pack, out_len, in_len, nr_zc_segs, 0,
+				  info->max_indirect_segments)) {
+			data_ring = 0;
+			indirect = pack.kind == P9_PACK_INDIRECT;
+			nr_msg_segs = pack.nr_msg_segs;
+			nr_reply_segs = pack.nr_reply_segs;
+			queue->stats.data_ring_full++;
+		}
 	}
-	addr = (char *) page_address(apage) + offset;
-	gnt_list_entry =
-	    get_grant((unsigned long) page_to_pfn(apage), info);
-	ring_req = RING_GET_REQUEST(&info->ring, info->ring.req_prod_pvt);
+	if (indirect)
+		err = get_grants(queue, &shadow->grants, pack.nr_pages);
+	else if (!data_ring)
+		err = get_slot(queue, shadow, out_len + in_len, reserve);
+	if (err)
+		goto out_free_id;
 	/*
-	 * FIX - will need to test for bad id when using multiple pages
+	 * the request is built in the shadow, so the grants can be revoked
+	 * when the response arrives, and copied to the ring when complete
 	 */
-	id = get_id_from_freelist ();
-	ring_req->id = id;
-	ring_req->gref = gnt_list_entry->gref;
-	ring_req->offset = info->offset;
-	ring_req->nrbytes = tot_sz;
+	ring_req = &shadow->req;
 	ring_req->out_len = out_len;
 	ring_req->in_len = in_len;
 	ring_req->tag = tag;
-	
-	info->offset += ring_req->nrbytes;
-	memcpy (addr, out_data, out_len);
-	addr += out_len;
+	shadow->nr_msg_segs = nr_msg_segs;
+	shadow->nr_reply_segs = nr_reply_segs;
+	if (indirect) {
+		/* the indirect pages are the last ones taken from the pool */
+		n = 0;
+		list_for_each_entry(gnt, &shadow->grants, node) {
+			if (n >= nr_msg_segs + nr_reply_segs) {
+				i = n - nr_msg_segs - nr_reply_segs;
+				shadow->indirect[i] = gnt;
+				indirect_grefs[i] = gnt->gref;
+			}
+			n++;
+		}
+		p9_pack_indirect(ring_req, indirect_grefs,
+				 n - nr_msg_segs - nr_reply_segs);
+		gnt_list_entry = list_first_entry(&shadow->grants,
+						  struct grant, node);
+		n = add_data_segments(shadow, 0, &gnt_list_entry,
+				      out_data, out_len);
+	} else if (data_ring) {
+		/* get_data_ring filled in where the message and reply go */
+		memcpy(queue->data_out.buf + ring_req->offset, out_data,
+		       out_len);
+		n = 0;
+	} else {
+		p9_pack_direct(ring_req, shadow->slot->gref,
+			       shadow->slot_offset, out_len + in_len);
+		memcpy ((char *) pfn_to_kaddr(shadow->slot->pfn) +
+			shadow->slot_offset, out_data, out_len);
+		n = 0;
+	}
+
 	/*
-	 * save where to start looking for the input
+	 * zero copy payload: out pages first, read only, then in pages
 	 */
-        info->addresses[id] = addr;
+	err = grant_zc_segments(queue, shadow, n, zc_out, 1);
+	if (err < 0)
+		goto out_put_grants;
+	n += err;
+	shadow->nr_out_segs = n;
+	if (indirect)
+		n = add_data_segments(shadow, n, &gnt_list_entry,
+				      NULL, in_len);
+	err = grant_zc_segments(queue, shadow, n, zc_in, 0);
+	if (err < 0) {
+		end_zc_segments(queue, shadow, nr_msg_segs,
+				shadow->nr_out_segs - nr_msg_segs);
+		goto out_put_grants;
+	}
+	n += err;
+	err = 0;
+	shadow->nr_segs = n;
+	p9_pack_segments(ring_req, n, shadow->nr_out_segs);
 
-	info->ring.req_prod_pvt++;
 	/*
-	 *  Now push the request and notify the other side
+	 * save where the reply goes, and the zero copy pages to give back
+	 * when the response arrives
 	 */
-	RING_PUSH_REQUESTS(&info->ring);
-	notify_remote_via_irq(info->irq);
+	shadow->out_data = out_data;
+	shadow->in_data = in_data;
+	if (zc_out)
+		shadow->zc_out = *zc_out;
+	if (zc_in)
+		shadow->zc_in = *zc_in;
+	shadow->zc_pinned = zc_pinned;
+	shadow->type = type;
+	shadow->t_queued = queued;
+	shadow->t_pushed = ktime_get();
+	p9_record_latency(info, shadow->type, P9_LAT_QUEUE,
+			  queued, shadow->t_pushed);
+	trace_p9front_submit(queue->id, queue->ring.req_prod_pvt, id, tag,
+			     shadow->type, out_len, in_len, n, indirect);
+
+	p9_ring_put_request(&queue->ring, ring_req);
+
+	queue->stats.requests++;
+	queue->stats.indirect += indirect;
+	queue->stats.data_ring += data_ring;
+	queue->stats.out_bytes += out_len + (zc_out ? zc_out->len : 0);
+	queue->stats.zc_grants += n - nr_msg_segs - nr_reply_segs;
+	queue->stats.inflight_max = max_t(unsigned int,
+			queue->stats.inflight_max,
+			queue->ring.req_prod_pvt - queue->ring.rsp_cons);
+	return 0;
+ out_put_grants:
+	put_request_data(queue, shadow);
+ out_free_id:
+	add_id_to_freelist(queue, id);
  out:
+	/*
+	 * no room on the ring or in the pool: the caller waits on the
+	 * channel's wait queue until p9_interrupt frees some
+	 */
+	if (err == -ENOSPC) {
+		queue->ring_bufs_avail = 0;
+		queue->stats.ring_full++;
+	}
 	return (err);
 }
 
+/*
+ * p9_drain_batch - move a batch taken off the submission list of @queue
+ *                  to its ring
+ *
+ * Called by the queue's submit owner only, so there is one producer.  The
+ * batch is in submission order; ring_lock is taken for each request in
+ * turn, keeping interrupts off for one copy at a time, and once more to
+ * push the batch with a single flush_requests, so with at most one
+ * notification.  Each entry is completed last, since its submitter may
+ * return as soon as it is.
+ */
+static void p9_drain_batch(struct p9_front_queue *queue,
+			   struct llist_node *batch)
+{
+	struct llist_node *node;
+	struct p9_submit *sub;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	for (node = batch; node; node = node->next) {
+		sub = llist_entry(node, struct p9_submit, node);
+		spin_lock_irqsave(&queue->ring_lock, flags);
+		sub->err = __p9front_handle_client_request(queue, sub->tag,
+				sub->out_data, sub->out_len,
+				sub->in_data, sub->in_len,
+				sub->zc_out, sub->zc_in,
+				sub->zc_pinned, sub->queued);
+		spin_unlock_irqrestore(&queue->ring_lock, flags);
+		n++;
+	}
+
+	spin_lock_irqsave(&queue->ring_lock, flags);
+	/*
+	 *  Now push the batch and notify the other side, unless it is
+	 *  still working through the ring or the queue is plugged
+	 */
+	if (!queue->plugged &&
+	    queue->ring.req_prod_pvt != queue->ring.sring->req_prod)
+		flush_requests(queue);
+	queue->stats.batches++;
+	queue->stats.batch_max = max(queue->stats.batch_max, n);
+	spin_unlock_irqrestore(&queue->ring_lock, flags);
+
+	while (batch) {
+		node = batch;
+		batch = node->next;
+		sub = llist_entry(node, struct p9_submit, node);
+		complete(&sub->done);
+	}
+}
+
+/*
+ * p9_take_batch - take the submission list of @queue whole, in submission
+ *                 order; submit owner only
+ */
+static struct llist_node *p9_take_batch(struct p9_front_queue *queue)
+{
+	return llist_reverse_order(llist_del_all(&queue->pending));
+}
+
+/*
+ * p9_pass_ownership - give up the submit ownership of @queue
+ *
+ * If requests came in meanwhile they are taken as the next batch, and the
+ * ownership goes to the submitter of the first of them, woken to drain
+ * it; otherwise the queue is left without an owner.  An owner checks the
+ * list again after letting go: a request added meanwhile is then handed
+ * on by it or drained by the submitter that took over.
+ */
+static void p9_pass_ownership(struct p9_front_queue *queue)
+{
+	struct llist_node *batch;
+	struct p9_submit *next;
+
+	for (;;) {
+		batch = p9_take_batch(queue);
+		if (batch) {
+			next = llist_entry(batch, struct p9_submit, node);
+			next->batch = batch;
+			complete(&next->done);
+			return;
+		}
+		clear_bit_unlock(P9_QUEUE_SUBMIT_OWNER, &queue->submit_flags);
+		smp_mb__after_atomic();
+		if (llist_empty(&queue->pending) ||
+		    test_and_set_bit_lock(P9_QUEUE_SUBMIT_OWNER,
+					  &queue->submit_flags))
+			return;
+	}
+}
+
+/*
+ * p9front_handle_client_request - submit a 9p message on a queue
+ *
+ * The request goes on the queue's lock free list.  The submitter that
+ * finds the queue without a submit owner becomes it, takes the list as it
+ * is and puts that batch on the ring, so submitters racing for one queue
+ * end up in one batch behind a single producer instead of taking the
+ * lock, and notifying, one at a time.  Everyone else sleeps until the
+ * owner has put its request on the ring, and returns what that gave; see
+ * __p9front_handle_client_request for the arguments and the errors.
+ *
+ * An owner drains only the one batch, then passes the ownership on to a
+ * submitter of what came in meanwhile, so under steady load no submitter
+ * is kept draining for others long after its own request went out.
+ */
+int p9front_handle_client_request (struct p9_front_queue *queue,
+					uint16_t tag,
+					char *out_data, int out_len,
+					char *in_data, int in_len,
+					struct p9_zc_payload *zc_out,
+					struct p9_zc_payload *zc_in,
+					int zc_pinned, ktime_t queued)
+{
+	struct p9_submit sub = {
+		.tag = tag,
+		.out_data = out_data,
+		.out_len = out_len,
+		.in_data = in_data,
+		.in_len = in_len,
+		.zc_out = zc_out,
+		.zc_in = zc_in,
+		.zc_pinned = zc_pinned,
+		.queued = queued,
+	};
+	struct llist_node *batch;
+
+	init_completion(&sub.done);
+	llist_add(&sub.node, &queue->pending);
+	if (!test_and_set_bit_lock(P9_QUEUE_SUBMIT_OWNER,
+				   &queue->submit_flags)) {
+		batch = p9_take_batch(queue);
+	} else {
+		wait_for_completion(&sub.done);
+		if (!sub.batch)
+			return sub.err;
+		/* handed the ownership, with a batch our request heads */
+		batch = sub.batch;
+	}
+	p9_drain_batch(queue, batch);
+	p9_pass_ownership(queue);
+	return sub.err;
+}
+
+static int p9_replay_cmp(const void *a, const void *b)
+{
+	const struct p9_replay *ra = a, *rb = b;
+
+	return ktime_compare(ra->pushed, rb->pushed);
+}
+
+/*
+ * p9_replay_room - whether p9front_replay can try queue @id again: it has
+ *                  room, or the device went away and the queue with it
+ */
+static int p9_replay_room(struct p9_front_info *info, unsigned int id)
+{
+	int idx, ret;
+
+	idx = srcu_read_lock(&info->srcu);
+	ret = info->connected != P9_STATE_CONNECTED ||
+	      info->queues[id].ring_bufs_avail;
+	srcu_read_unlock(&info->srcu, idx);
+	return ret;
+}
+
+/*
+ * p9front_replay - submit the requests p9_free took off the old rings, in
+ *                  the order they were first pushed
+ *
+ * Each goes back on the queue it was on, or the one with the same index
+ * modulo the new number of queues.  The new rings may be smaller; when
+ * one is full we wait for responses to free some room, as p9_xen_submit
+ * does, with p9front_mutex dropped: it is shared by every device.
+ * Meanwhile p9front_cancel may drop a request, and p9_free may tear the
+ * device down again, keeping what is left of info->replay; we stop then,
+ * and the requests already back on a ring are marked dropped so they are
+ * not kept twice.  A request the new connection cannot take fails with
+ * EIO.  Called from info->replay_work with p9front_mutex held, before
+ * is_ready is set.
+ */
+static void p9front_replay(struct p9_front_info *info)
+{
+	struct p9_replay *r;
+	unsigned int i, id, n = 0;
+	int err;
+
+	if (!info->nr_replay)
+		return;
+	sort(info->replay, info->nr_replay, sizeof(*info->replay),
+	     p9_replay_cmp, NULL);
+	for (i = 0; i < info->nr_replay; i++) {
+		r = &info->replay[i];
+		id = r->queue % info->nr_queues;
+		err = -ENOSPC;
+		while (err == -ENOSPC && !r->dropped) {
+			err = p9front_handle_client_request(&info->queues[id],
+					r->tag, r->out_data, r->out_len,
+					r->in_data, r->in_len,
+					r->zc_out.pages ? &r->zc_out : NULL,
+					r->zc_in.pages ? &r->zc_in : NULL,
+					r->zc_pinned, r->queued);
+			if (err != -ENOSPC)
+				break;
+			mutex_unlock(&p9front_mutex);
+			/*
+			 * a worker takes no signals: interruptible only keeps
+			 * a slow backend off the hung task check
+			 */
+			wait_event_interruptible(*info->chan->vc_wq,
+						 p9_replay_room(info, id));
+			mutex_lock(&p9front_mutex);
+			if (info->connected != P9_STATE_CONNECTED)
+				return;
+		}
+		if (r->dropped)
+			continue;
+		r->dropped = true;
+		if (err) {
+			p9_release_zc(&r->zc_out, r->zc_pinned);
+			p9_release_zc(&r->zc_in, r->zc_pinned);
+			p9_xen_req_error(info->chan, r->tag, r->in_data, EIO);
+			continue;
+		}
+		n++;
+	}
+	printk(KERN_INFO "p9front: %s: replayed %u of %u requests\n",
+	       info->xbdev ? info->xbdev->nodename : "loop", n,
+	       info->nr_replay);
+	kfree(info->replay);
+	info->replay = NULL;
+	info->nr_replay = 0;
+}
+
+/*
+ * p9front_replay_work - replay what was in flight, then let new requests
+ *                       in
+ *
+ * Queued by p9front_connect rather than run from it: p9front_replay may
+ * wait for the backend, and the xenwatch thread p9front_connect runs on
+ * must stay free to deliver the backend's Closing, whose p9_free is what
+ * stops a replay the backend no longer answers.
+ */
+static void p9front_replay_work(struct work_struct *work)
+{
+	struct p9_front_info *info = container_of(work, struct p9_front_info,
+						  replay_work);
+
+	/* what was in flight goes first, new requests wait for is_ready */
+	mutex_lock(&p9front_mutex);
+	p9front_replay(info);
+	mutex_unlock(&p9front_mutex);
+
+	/* unless the backend went away again while we replayed */
+	spin_lock_irq(&info->io_lock);
+	if (info->connected == P9_STATE_CONNECTED)
+		info->is_ready = 1;
+	spin_unlock_irq(&info->io_lock);
+	if (info->chan->vc_wq)
+		wake_up_all(info->chan->vc_wq);
+}
+
 /*
  * Invoked when the backend is finally 'ready' 
  */
 
+/*
+ * p9front_set_max_msize - work out the largest msize the device carries
+ *
+ * Without indirect requests a message and the room for its reply share
+ * one data page, so msize can be at most half a page, or half a data ring
+ * if there are data rings and a zero copy payload of msize still fits in
+ * the segments of the request itself.  With indirect requests, the
+ * largest request is a message or reply of msize in its own pages, or a
+ * zero copy payload of msize that may straddle one more page than it
+ * fills, plus a page each for the other direction and the 9p header: up
+ * to three segments more than msize has pages.
+ */
+static void p9front_set_max_msize(struct p9_front_info *info)
+{
+	unsigned int max;
+
+	if (info->max_indirect_segments > 3)
+		max = (info->max_indirect_segments - 3) * PAGE_SIZE;
+	else
+		max = max_t(unsigned int, PAGE_SIZE / 2,
+			    min_t(unsigned int,
+				  info->nr_data_ring_pages * PAGE_SIZE / 2,
+				  (P9_MAX_SEGMENTS_PER_REQUEST - 1) *
+				  PAGE_SIZE));
+	if (info->max_request_size)
+		max = min(max, info->max_request_size);
+	info->max_msize = max;
+}
+
+/*
+ * p9front_max_msize - largest msize the device can carry, 0 while it is
+ *                     not connected and that is not known yet
+ */
+unsigned int p9front_max_msize(struct p9_front_info *info)
+{
+	return info->connected == P9_STATE_CONNECTED ? info->max_msize : 0;
+}
+
+/*
+ * p9front_fill_pools - give each queue its pool of data pages: one per
+ *                      ring slot, so a full ring never runs the pool dry,
+ *                      plus the pages of a few of the largest indirect
+ *                      requests
+ */
+static int p9front_fill_pools(struct p9_front_info *info)
+{
+	unsigned int i, nr_grants = 0;
+	int err;
+
+	if (info->max_indirect_segments)
+		nr_grants = P9_INDIRECT_RESERVE *
+			(info->max_indirect_segments +
+			 P9_INDIRECT_PAGES(info->max_indirect_segments));
+	for (i = 0; i < info->nr_queues; i++) {
+		struct p9_front_queue *queue = &info->queues[i];
+
+		err = fill_grant_buffer(queue,
+					RING_SIZE(&queue->ring) + nr_grants);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
 void p9front_connect(struct p9_front_info *info)
 {
-  printk(KERN_INFO "\nin p9front_connect\n");
+	unsigned int persistent, indirect_segments;
+	int err;
+
+	printk(KERN_INFO "\nin p9front_connect\n");
+	if (info->connected == P9_STATE_CONNECTED)
+		return;
+
+	err = xenbus_gather(XBT_NIL, info->xbdev->otherend,
+			    "feature-persistent", "%u", &persistent,
+			    NULL);
+	if (err)
+		info->feature_persistent = 0;
+	else
+		info->feature_persistent = persistent;
+
+	err = xenbus_gather(XBT_NIL, info->xbdev->otherend,
+			    "feature-max-indirect-segments", "%u",
+			    &indirect_segments, NULL);
+	if (err)
+		info->max_indirect_segments = 0;
+	else
+		info->max_indirect_segments = min_t(unsigned int,
+				min_t(unsigned int, indirect_segments,
+				      xen_p9_max_indirect_segments),
+				P9_MAX_INDIRECT_PAGES_PER_REQUEST *
+				P9_SEGS_PER_INDIRECT_FRAME);
+	p9front_set_max_msize(info);
+
+	err = p9front_fill_pools(info);
+	if (err) {
+		xenbus_dev_fatal(info->xbdev, err, "allocating data pages");
+		return;
+	}
+
 	spin_lock_irq(&info->io_lock);
 	xenbus_switch_state(info->xbdev, XenbusStateConnected);
 	info->connected = P9_STATE_CONNECTED;
+	spin_unlock_irq(&info->io_lock);
+
+	schedule_work(&info->replay_work);
+}
+
+/*
+ * p9front_loop_attach - set up a device served by the loopback backend
+ *
+ * Does what talk_to_9p_back and p9front_connect do for a xenbus device,
+ * with the features the loopback backend has: persistent grants,
+ * indirect requests and data rings.  The rings are not shared through
+ * grants, the backend runs in this kernel and uses them directly.
+ */
+int p9front_loop_attach(struct p9_front_info *info, unsigned int nr_queues)
+{
+	unsigned int i;
+	int err;
+
+	info->nr_ring_pages = 1 << min_t(unsigned int, xen_p9_max_ring_order,
+					 P9_MAX_RING_PAGE_ORDER);
+	info->nr_data_ring_pages = xen_p9_data_rings ?
+		1 << min_t(unsigned int, xen_p9_max_data_ring_order,
+			   P9_MAX_DATA_RING_PAGE_ORDER) : 0;
+	err = p9_init_queues(info, max_t(unsigned int, 1,
+					 min(nr_queues, xen_p9_max_queues)));
+	if (err)
+		return err;
+	for (i = 0; i < info->nr_queues; i++) {
+		err = p9_init_ring(&info->queues[i]);
+		if (err)
+			goto fail;
+	}
+	info->feature_persistent = 1;
+	info->max_indirect_segments = min_t(unsigned int,
+				xen_p9_max_indirect_segments,
+				P9_MAX_INDIRECT_PAGES_PER_REQUEST *
+				P9_SEGS_PER_INDIRECT_FRAME);
+	p9front_set_max_msize(info);
+	err = p9front_fill_pools(info);
+	if (err)
+		goto fail;
+
+	spin_lock_irq(&info->io_lock);
+	info->connected = P9_STATE_CONNECTED;
 	info->is_ready = 1;
-	init_freelist ();
 	spin_unlock_irq(&info->io_lock);
-	return;
+	return 0;
+ fail:
+	p9_free(info, 0);
+	return err;
 }
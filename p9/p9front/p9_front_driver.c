@@ -46,6 +46,8 @@
 #include <linux/scatterlist.h>
 #include <linux/bitmap.h>
 #include <linux/list.h>
+#include <linux/vmalloc.h>
+#include <linux/swap.h>
 
 #include <xen/xen.h>
 #include <xen/xenbus.h>
@@ -60,10 +62,22 @@
 #include <asm/xen/hypervisor.h>
 #include "trans_common.h"
 #include "p9.h"
+#include "p9_ring.h"
+#include "p9_pack.h"
 #include "xen_9p_front.h"
 
-static struct list_head xen9p_chan_list;
-static DEFINE_MUTEX(xen_9p_lock);
+/*
+ * p9_mount_tag_show - the mount tag of the device, as trans_virtio shows it
+ */
+static ssize_t p9_mount_tag_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct p9_front_info *info = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%s\n", info->chan->tag);
+}
+
+static DEVICE_ATTR(mount_tag, 0444, p9_mount_tag_show, NULL);
 
 /**
  * p9_xen_probe - probe for existence of 9P channels
@@ -90,7 +104,8 @@ static int p9_xen_probe(struct xenbus_device *dev,
 				    "mount_tag_len","%i", &tag_len);
 	printk (KERN_INFO "mount tag len is %i", tag_len);
 	if (err && (tag_len>0)) {
-		tag = kzalloc(tag_len, GFP_KERNEL);
+		/* and the terminating NUL xenbus_scanf stores */
+		tag = kzalloc(tag_len + 1, GFP_KERNEL);
 		if (!tag) {
 			err = -ENOMEM;
 			goto fail;
@@ -123,11 +138,14 @@ static int p9_xen_probe(struct xenbus_device *dev,
 		err = -ENOMEM;
 		goto out_free_chan;
 	}
-	spin_lock_init(&info->io_lock);
+	err = p9front_init_info(info, chan);
+	if (err) {
+		kfree(info);
+		goto out_free_chan;
+	}
 	info->xbdev = dev;
-	info->connected = P9_STATE_DISCONNECTED;
-	info->chan = chan;
-	chan->drv_info = info;
+	/* the histograms are only statistics; carry on without them */
+	info->latency = vzalloc(sizeof(*info->latency));
 	/* Front end dir is a number, which is used as the id. */
 	dev_set_drvdata(&dev->dev, info);
 	printk (KERN_INFO "set drive data\n");
@@ -143,34 +161,32 @@ static int p9_xen_probe(struct xenbus_device *dev,
 	 * init scatter gather list
 	 */
 	sg_init_table(chan->sg, NUM_P9_SGLISTS);
-	/*  not sure what this is for, but saving just in case.
-	 err = sysfs_create_file(&(vdev->dev.kobj), &dev_attr_mount_tag.attr);
-	 if (err) {
-	 goto out_free_tag;
-	 }
-	 */
+	/* lets userspace find the device to mount by its tag */
+	err = device_create_file(&dev->dev, &dev_attr_mount_tag);
+	if (err)
+		goto xen_err;
 	chan->vc_wq = kmalloc(sizeof(wait_queue_head_t), GFP_KERNEL);
 	if (!chan->vc_wq) {
+		device_remove_file(&dev->dev, &dev_attr_mount_tag);
 		err = -ENOMEM;
-		goto out_free_tag;
+		goto xen_err;
 	}
 	init_waitqueue_head(chan->vc_wq);
 	printk (KERN_INFO "wait q head initialized\n");
 
-	/* Ceiling limit to avoid denial of service attacks
-	 * need to figure out what it should be
-	 */
-	chan->p9_max_pages = 37; /* virtio called nr_free_buffer_pages */
+	/* Ceiling limit to avoid denial of service attacks, as virtio sets it */
+	chan->p9_max_pages = nr_free_buffer_pages() / 4;
 
-	mutex_lock(&xen_9p_lock);
-	list_add_tail(&chan->chan_list, &xen9p_chan_list);
-	mutex_unlock(&xen_9p_lock);
+	p9_xen_add_chan(chan);
+	p9front_debugfs_add(info);
 	return 0;
 
 xen_err:	
-	kfree(info);
 	dev_set_drvdata(&dev->dev, NULL);
 	printk(KERN_INFO "exiting xen err\n");
+	/* frees whatever rings were set up, the channel and the tag too */
+	p9front_remove(info);
+	return err;
 out_free_chan:
 	kfree(chan);	
 out_free_tag:
@@ -194,8 +210,17 @@ static void p9_xen_back_changed(struct xenbus_device *dev,
 		backend_state);
 
 	switch (backend_state) {
-	case XenbusStateInitialising:
 	case XenbusStateInitWait:
+		/*
+		 * a restarted backend: set the rings up again, the requests
+		 * p9front_closing kept are replayed once it connects
+		 */
+		if (dev->state == XenbusStateClosed &&
+		    talk_to_9p_back(dev, info))
+			xenbus_dev_fatal(dev, -EIO, "reconnecting");
+		break;
+
+	case XenbusStateInitialising:
 	case XenbusStateInitialised:
 	case XenbusStateReconfiguring:
 	case XenbusStateReconfigured:
@@ -234,7 +259,8 @@ static int p9_xen_resume(struct xenbus_device *dev)
 	printk(KERN_INFO "resume");
 	dev_dbg(&dev->dev, "blkfront_resume: %s\n", dev->nodename);
 
-	p9_free(info, info->connected == P9_STATE_CONNECTED);
+	/* keep the requests saved by an earlier p9front_closing as well */
+	p9_free(info, info->connected != P9_STATE_DISCONNECTED);
 
 	/*
 	 * talk_to_9p_back will also set the front end state to Initialized
@@ -261,31 +287,20 @@ static int p9_xen_remove(struct xenbus_device *xbdev)
 	struct p9_front_info *info = dev_get_drvdata(&xbdev->dev);
 	struct xen9p_chan *chan = info->chan;
 
-	if (chan->inuse)
-		p9_xen_close(chan->client);
-
 	printk(KERN_INFO "remove");
 	dev_dbg(&xbdev->dev, "%s removed", xbdev->nodename);
+	p9front_debugfs_remove(info);
+	/* no new mount finds the channel */
+	p9_xen_del_chan(chan);
+	device_remove_file(&xbdev->dev, &dev_attr_mount_tag);
+	dev_set_drvdata(&xbdev->dev, NULL);
 
 	/*
-	 * frees up xen specific data
+	 * frees up xen specific data; a mount still on the channel keeps
+	 * info and chan until it is closed, its requests failing with EIO
 	 */
-	p9_free(info, 0);
-	mutex_lock(&xen_9p_lock);
-	list_del(&chan->chan_list);
-	mutex_unlock(&xen_9p_lock);
-	/*      sysfs_remove_file(&(vdev->dev.kobj), &dev_attr_mount_tag.attr);
-	   kfree(chan->tag);
-FIX - check correct trans_virtio - for how to clean up channels.
- */
-
-	kfree(chan->vc_wq);
-	kfree(chan);
 	info->xbdev = NULL;
-	/* 
-	 *  CHECK (FIX ME?) Do I need to free other fields of info
-	 */
-	kfree(info);
+	p9front_remove(info);
 	printk(KERN_INFO "exiting\n");
 	return 0;
 }
@@ -329,10 +344,30 @@ static int __init xlp9_init(void)
 	printk(KERN_INFO "\n\n in p9_init\n");
 	init_xen_9p();
 	printk (KERN_INFO "returned from init_xen_9p");
+	p9front_debugfs_register();
 	p9front_driver.driver.name = "p9";
 	p9front_driver.driver.owner = THIS_MODULE;
-	ret = xenbus_register_frontend(&p9front_driver);
+	/*
+	 * off Xen there is no xenbus to register with; only the loopback
+	 * backend can serve mounts there
+	 */
+	if (xen_domain()) {
+		ret = xenbus_register_frontend(&p9front_driver);
+		if (ret)
+			goto out_trans;
+	}
+	ret = p9_loop_init();
+	if (ret)
+		goto out_xenbus;
 	printk(KERN_INFO "exiting p9_init\n");
+	return 0;
+
+out_xenbus:
+	if (xen_domain())
+		xenbus_unregister_driver(&p9front_driver);
+out_trans:
+	p9front_debugfs_unregister();
+	cleanup_xen_9p();
 	return ret;
 }
 
@@ -342,7 +377,10 @@ module_init(xlp9_init);
 static void __exit xlp9_exit(void)
 {
 	printk(KERN_INFO "exit");
-	xenbus_unregister_driver(&p9front_driver);
+	p9_loop_exit();
+	if (xen_domain())
+		xenbus_unregister_driver(&p9front_driver);
+	p9front_debugfs_unregister();
 	cleanup_xen_9p ();
 	printk(KERN_INFO "exiting\n");
 }
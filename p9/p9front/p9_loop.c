@@ -0,0 +1,1289 @@
+/*
+ * The Xen 9p transport driver: loopback backend
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  Serves the rings of a p9 device from this same kernel, backed by a
+ *  local directory, so the whole transport (v9fs, trans_xen9p.c, the
+ *  rings, p9_interrupt and req_done) can be exercised and measured on a
+ *  machine without Xen.
+ *
+ *  Loading the module with loopback_dir=<directory> creates one device,
+ *  in place of a xenbus probe, with the tag given by loopback_tag
+ *  ("loop" by default):
+ *
+ *      insmod p9frontall.ko loopback_dir=/srv/export
+ *      mount -t 9p -o trans=xen,version=9p2000.L loop /mnt
+ *
+ *  The device negotiates the features this backend has: persistent
+ *  grants, indirect requests, data rings, one queue per online CPU (up to
+ *  max_queues) and the largest rings max_ring_page_order and
+ *  max_data_ring_page_order allow.  Nothing is granted
+ *  to another domain: the front end hands this backend its pages in a
+ *  gref table (p9_loop_grant), and the event channel is a work item per
+ *  queue one way and p9front_event the other.
+ *
+ *  Requests are read in the format of p9.h and answered with 9P2000.L
+ *  replies.  Enough of the protocol is served to mount, walk, stat, read,
+ *  write, create, make directories, list and remove; other requests get
+ *  Rlerror EOPNOTSUPP.  Files are accessed with the credentials of the
+ *  kernel worker, so owners and permissions are not enforced and new
+ *  files belong to root.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/idr.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/statfs.h>
+#include <linux/uidgid.h>
+#include <linux/swap.h>
+#include <asm/unaligned.h>
+
+#include <xen/xen.h>
+#include <xen/xenbus.h>
+#include <xen/grant_table.h>
+
+#include <net/9p/9p.h>
+#include <net/9p/client.h>
+#include "p9.h"
+#include "p9_ring.h"
+#include "p9_pack.h"
+#include "xen_9p_front.h"
+
+/*
+ * largest message either way, the device's max_request_size; msize is
+ * clamped to it
+ */
+#define P9_LOOP_MAX_MSG		(PAGE_SIZE * NUM_P9_SGLISTS)
+#define P9_LOOP_HDR		7	/* size[4] type[1] tag[2] */
+#define P9_LOOP_FID_BITS	6
+#define P9_LOOP_AT_REMOVEDIR	0x200
+
+static char *p9_loop_dir;
+module_param_named(loopback_dir, p9_loop_dir, charp, S_IRUGO);
+MODULE_PARM_DESC(loopback_dir, "Serve a device from this directory with the in-kernel loopback backend");
+
+static char *p9_loop_tag = "loop";
+module_param_named(loopback_tag, p9_loop_tag, charp, S_IRUGO);
+MODULE_PARM_DESC(loopback_tag, "Mount tag of the loopback device");
+
+/*
+ * struct p9_loop_fid - a fid of the client
+ * @path: the file the fid names
+ * @file: the file once opened by Tlopen or Tlcreate
+ */
+struct p9_loop_fid {
+	u32			fid;
+	struct path		path;
+	struct file		*file;
+	struct hlist_node	node;
+};
+
+/*
+ * struct p9_loop_queue - the backend end of one queue of the device
+ * @ring : the back ring over the front end's shared ring
+ * @work : serves the ring; queued by p9_loop_kick
+ * @msg, @reply: the message and reply of the request being served
+ */
+struct p9_loop_queue {
+	struct p9_loop		*loop;
+	struct p9_front_queue	*front;
+	struct p9_back_ring	ring;
+	struct work_struct	work;
+	char			*msg;
+	char			*reply;
+};
+
+/*
+ * struct p9_loop - the loopback device
+ * @root  : the directory served
+ * @grants: gref -> page of every page the front end granted
+ * @fids  : the fids of the client, under @fid_lock.  The client does not
+ *          use a fid while it clunks it, so a fid looked up stays valid
+ *          while its request is served.
+ */
+struct p9_loop {
+	struct p9_front_info	*info;
+	struct path		root;
+	spinlock_t		grant_lock;
+	struct idr		grants;
+	struct mutex		fid_lock;
+	DECLARE_HASHTABLE(fids, P9_LOOP_FID_BITS);
+	struct workqueue_struct	*wq;
+	struct p9_loop_queue	*queues;
+	unsigned int		nr_queues;
+};
+
+static struct p9_loop *p9_loop_dev;
+
+/*
+ * p9_loop_grant - stands in for gnttab_grant_foreign_access; the pages are
+ *                 granted read/write whatever the front end asked for
+ */
+int p9_loop_grant(struct p9_loop *loop, unsigned long pfn)
+{
+	unsigned long flags;
+	int ref;
+
+	spin_lock_irqsave(&loop->grant_lock, flags);
+	ref = idr_alloc(&loop->grants, pfn_to_page(pfn), 1, 0, GFP_ATOMIC);
+	spin_unlock_irqrestore(&loop->grant_lock, flags);
+	return ref;
+}
+
+void p9_loop_end_grant(struct p9_loop *loop, grant_ref_t gref)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&loop->grant_lock, flags);
+	idr_remove(&loop->grants, gref);
+	spin_unlock_irqrestore(&loop->grant_lock, flags);
+}
+
+/*
+ * p9_loop_kick - stands in for the event channel to the backend
+ */
+void p9_loop_kick(struct p9_loop *loop, unsigned int queue)
+{
+	queue_work(loop->wq, &loop->queues[queue].work);
+}
+
+/*
+ * p9_loop_copy - copy between @buf and a granted page
+ * @to_page - copy @buf into the page, rather than out of it
+ */
+static int p9_loop_copy(struct p9_loop *loop, grant_ref_t gref,
+			unsigned int offset, char *buf, unsigned int len,
+			bool to_page)
+{
+	unsigned long flags;
+	struct page *page;
+	char *addr;
+
+	if (offset + len > PAGE_SIZE)
+		return -EINVAL;
+	/*
+	 * under grant_lock, so once p9_loop_end_grant returns the page is
+	 * not touched again, as with a real grant that is ended
+	 */
+	spin_lock_irqsave(&loop->grant_lock, flags);
+	page = idr_find(&loop->grants, gref);
+	if (page) {
+		addr = kmap_atomic(page);
+		if (to_page)
+			memcpy(addr + offset, buf, len);
+		else
+			memcpy(buf, addr + offset, len);
+		kunmap_atomic(addr);
+	}
+	spin_unlock_irqrestore(&loop->grant_lock, flags);
+	return page ? 0 : -EINVAL;
+}
+
+/*
+ * p9_loop_ring_copy - copy between @buf and a span of a data ring of the
+ *                     front end queue; the span does not wrap
+ * @to_ring - copy @buf into the ring, rather than out of it
+ */
+static int p9_loop_ring_copy(struct p9_loop *loop, struct p9_data_ring *dr,
+			     unsigned int offset, char *buf, unsigned int len,
+			     bool to_ring)
+{
+	unsigned int nr;
+	int err;
+
+	if (offset > dr->size || len > dr->size - offset)
+		return -EINVAL;
+	while (len) {
+		nr = min_t(unsigned int, len, PAGE_SIZE - offset % PAGE_SIZE);
+		err = p9_loop_copy(loop, dr->ref[offset / PAGE_SIZE],
+				   offset % PAGE_SIZE, buf, nr, to_ring);
+		if (err)
+			return err;
+		offset += nr;
+		buf += nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+/*
+ * p9_loop_seg - segment @n of a request
+ */
+static int p9_loop_seg(struct p9_loop *loop, p9_request_t *req,
+		       unsigned int n, struct p9_request_segment *seg)
+{
+	if (req->nr_segments != P9_SEGMENTS_INDIRECT) {
+		*seg = req->seg[n];
+		return 0;
+	}
+	return p9_loop_copy(loop,
+			    req->indirect.indirect_grefs[n /
+						P9_SEGS_PER_INDIRECT_FRAME],
+			    (n % P9_SEGS_PER_INDIRECT_FRAME) * sizeof(*seg),
+			    (char *) seg, sizeof(*seg), false);
+}
+
+/*
+ * p9_loop_xfer - copy one direction of a request
+ *
+ * @out - read the message into @buf, of @len bytes; otherwise write the
+ *        @len bytes of the reply in @buf into the reply room
+ *
+ * The message is the out_len bytes of the request followed by its zero
+ * copy out payload, the reply room the in_len bytes for the reply
+ * followed by the zero copy in pages (see p9.h).  Returns the number of
+ * bytes copied, or a negative errno.
+ */
+static int p9_loop_xfer(struct p9_loop_queue *lq, p9_request_t *req,
+			bool out, char *buf, unsigned int len)
+{
+	struct p9_loop *loop = lq->loop;
+	struct p9_request_segment seg;
+	unsigned int done = 0, n, first, last, nr;
+	int err;
+
+	if (req->nr_segments != P9_SEGMENTS_INDIRECT &&
+	    req->gref == P9_DATA_RING_REF) {
+		/* the message, or room for the reply, in a data ring */
+		nr = min(len, out ? req->out_len : req->in_len);
+		if (out)
+			err = p9_loop_ring_copy(loop, &lq->front->data_out,
+						req->offset, buf, nr, false);
+		else
+			err = p9_loop_ring_copy(loop, &lq->front->data_in,
+						req->nrbytes, buf, nr, true);
+		if (err)
+			return err;
+		done = nr;
+		first = out ? 0 : req->nr_out_segments;
+		last = out ? req->nr_out_segments : req->nr_segments;
+	} else if (req->nr_segments != P9_SEGMENTS_INDIRECT) {
+		/* the message, and room for the reply after it */
+		nr = min(len, out ? req->out_len : req->in_len);
+		err = p9_loop_copy(loop, req->gref,
+				   req->offset + (out ? 0 : req->out_len),
+				   buf, nr, !out);
+		if (err)
+			return err;
+		done = nr;
+		first = out ? 0 : req->nr_out_segments;
+		last = out ? req->nr_out_segments : req->nr_segments;
+	} else {
+		first = out ? 0 : req->indirect.nr_out_segments;
+		last = out ? req->indirect.nr_out_segments :
+			     req->indirect.nr_segments;
+	}
+	for (n = first; n < last && done < len; n++) {
+		err = p9_loop_seg(loop, req, n, &seg);
+		if (err)
+			return err;
+		nr = min_t(unsigned int, seg.nrbytes, len - done);
+		err = p9_loop_copy(loop, seg.gref, seg.offset, buf + done, nr,
+				   !out);
+		if (err)
+			return err;
+		done += nr;
+	}
+	if (!out && done < len)
+		return -EMSGSIZE;
+	return done;
+}
+
+/*
+ * 9P message encoding; a read past the end of a message sets @err
+ */
+struct p9_loop_pdu {
+	char		*data;
+	size_t		size;
+	size_t		pos;
+	int		err;
+};
+
+static void *pdu_take(struct p9_loop_pdu *pdu, size_t len)
+{
+	void *p = pdu->data + pdu->pos;
+
+	if (pdu->pos + len > pdu->size) {
+		pdu->err = -EPROTO;
+		return NULL;
+	}
+	pdu->pos += len;
+	return p;
+}
+
+static u8 pdu_u8(struct p9_loop_pdu *pdu)
+{
+	u8 *p = pdu_take(pdu, 1);
+
+	return p ? *p : 0;
+}
+
+static u16 pdu_u16(struct p9_loop_pdu *pdu)
+{
+	void *p = pdu_take(pdu, 2);
+
+	return p ? get_unaligned_le16(p) : 0;
+}
+
+static u32 pdu_u32(struct p9_loop_pdu *pdu)
+{
+	void *p = pdu_take(pdu, 4);
+
+	return p ? get_unaligned_le32(p) : 0;
+}
+
+static u64 pdu_u64(struct p9_loop_pdu *pdu)
+{
+	void *p = pdu_take(pdu, 8);
+
+	return p ? get_unaligned_le64(p) : 0;
+}
+
+/* a string of the message, not NUL terminated */
+static char *pdu_str(struct p9_loop_pdu *pdu, u16 *len)
+{
+	*len = pdu_u16(pdu);
+	return pdu_take(pdu, *len);
+}
+
+static void put_u8(struct p9_loop_pdu *pdu, u8 v)
+{
+	u8 *p = pdu_take(pdu, 1);
+
+	if (p)
+		*p = v;
+}
+
+static void put_u16(struct p9_loop_pdu *pdu, u16 v)
+{
+	void *p = pdu_take(pdu, 2);
+
+	if (p)
+		put_unaligned_le16(v, p);
+}
+
+static void put_u32(struct p9_loop_pdu *pdu, u32 v)
+{
+	void *p = pdu_take(pdu, 4);
+
+	if (p)
+		put_unaligned_le32(v, p);
+}
+
+static void put_u64(struct p9_loop_pdu *pdu, u64 v)
+{
+	void *p = pdu_take(pdu, 8);
+
+	if (p)
+		put_unaligned_le64(v, p);
+}
+
+static void put_str(struct p9_loop_pdu *pdu, const char *s, u16 len)
+{
+	char *p;
+
+	put_u16(pdu, len);
+	p = pdu_take(pdu, len);
+	if (p)
+		memcpy(p, s, len);
+}
+
+static u8 p9_loop_qid_type(umode_t mode)
+{
+	if (S_ISDIR(mode))
+		return P9_QTDIR;
+	if (S_ISLNK(mode))
+		return P9_QTSYMLINK;
+	return P9_QTFILE;
+}
+
+static void put_qid(struct p9_loop_pdu *pdu, struct inode *inode)
+{
+	put_u8(pdu, p9_loop_qid_type(inode->i_mode));
+	put_u32(pdu, 0);
+	put_u64(pdu, inode->i_ino);
+}
+
+/*
+ * a name of a single path component, NUL terminated
+ */
+static char *p9_loop_name(struct p9_loop_pdu *in)
+{
+	char *name;
+	u16 len;
+
+	name = pdu_str(in, &len);
+	if (!name)
+		return ERR_PTR(-EPROTO);
+	if (!len || memchr(name, '/', len) || memchr(name, 0, len))
+		return ERR_PTR(-EINVAL);
+	name = kstrndup(name, len, GFP_KERNEL);
+	return name ? name : ERR_PTR(-ENOMEM);
+}
+
+/*
+ * fids
+ */
+static struct p9_loop_fid *p9_loop_fid(struct p9_loop *loop, u32 fid)
+{
+	struct p9_loop_fid *f;
+
+	mutex_lock(&loop->fid_lock);
+	hash_for_each_possible(loop->fids, f, node, fid)
+		if (f->fid == fid)
+			goto out;
+	f = NULL;
+ out:
+	mutex_unlock(&loop->fid_lock);
+	return f;
+}
+
+/*
+ * p9_loop_new_fid - add @fid, naming @path; takes a reference on @path
+ */
+static int p9_loop_new_fid(struct p9_loop *loop, u32 fid, struct path *path)
+{
+	struct p9_loop_fid *f;
+
+	if (p9_loop_fid(loop, fid))
+		return -EEXIST;
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	f->fid = fid;
+	f->path = *path;
+	path_get(path);
+	mutex_lock(&loop->fid_lock);
+	hash_add(loop->fids, &f->node, fid);
+	mutex_unlock(&loop->fid_lock);
+	return 0;
+}
+
+static void p9_loop_put_fid(struct p9_loop *loop, struct p9_loop_fid *f)
+{
+	mutex_lock(&loop->fid_lock);
+	hash_del(&f->node);
+	mutex_unlock(&loop->fid_lock);
+	if (f->file)
+		fput(f->file);
+	path_put(&f->path);
+	kfree(f);
+}
+
+static void p9_loop_put_fids(struct p9_loop *loop)
+{
+	struct p9_loop_fid *f;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(loop->fids, bkt, tmp, f, node)
+		p9_loop_put_fid(loop, f);
+}
+
+static int p9_loop_open_flags(u32 flags)
+{
+	static const struct {
+		u32 dotl;
+		int flag;
+	} map[] = {
+		{ P9_DOTL_CREATE, O_CREAT },
+		{ P9_DOTL_EXCL, O_EXCL },
+		{ P9_DOTL_TRUNC, O_TRUNC },
+		{ P9_DOTL_APPEND, O_APPEND },
+		{ P9_DOTL_NONBLOCK, O_NONBLOCK },
+		{ P9_DOTL_DSYNC, O_DSYNC },
+		{ P9_DOTL_DIRECT, O_DIRECT },
+		{ P9_DOTL_DIRECTORY, O_DIRECTORY },
+		{ P9_DOTL_NOFOLLOW, O_NOFOLLOW },
+		{ P9_DOTL_NOATIME, O_NOATIME },
+		{ P9_DOTL_SYNC, O_SYNC },
+	};
+	int i, oflags = (flags & P9_DOTL_ACCMODE) | O_LARGEFILE;
+
+	for (i = 0; i < ARRAY_SIZE(map); i++)
+		if (flags & map[i].dotl)
+			oflags |= map[i].flag;
+	return oflags;
+}
+
+/*
+ * the requests; each reads its message from @in and writes its reply
+ * after the header in @out, or returns a negative errno for Rlerror
+ */
+
+static int p9_loop_version(struct p9_loop *loop, struct p9_loop_pdu *in,
+			   struct p9_loop_pdu *out)
+{
+	u32 msize = pdu_u32(in);
+	char *version;
+	u16 len;
+
+	version = pdu_str(in, &len);
+	if (!version)
+		return -EPROTO;
+	/* a new session: the fids of the last one are gone */
+	p9_loop_put_fids(loop);
+	put_u32(out, min_t(u32, msize, P9_LOOP_MAX_MSG));
+	if (len == 8 && !memcmp(version, "9P2000.L", 8))
+		put_str(out, version, len);
+	else
+		put_str(out, "unknown", 7);
+	return 0;
+}
+
+static int p9_loop_attach(struct p9_loop *loop, struct p9_loop_pdu *in,
+			  struct p9_loop_pdu *out)
+{
+	u32 fid = pdu_u32(in);
+	int err;
+
+	/* afid, uname, aname and n_uname are ignored */
+	err = p9_loop_new_fid(loop, fid, &loop->root);
+	if (err)
+		return err;
+	put_qid(out, loop->root.dentry->d_inode);
+	return 0;
+}
+
+/*
+ * p9_loop_walk_one - look up one component from @path, not above the root
+ */
+static int p9_loop_walk_one(struct p9_loop *loop, struct path *path,
+			    const char *name)
+{
+	struct path next;
+	int err;
+
+	if (!strcmp(name, "..") && path->dentry == loop->root.dentry &&
+	    path->mnt == loop->root.mnt)
+		return 0;
+	err = vfs_path_lookup(path->dentry, path->mnt, name, 0, &next);
+	if (err)
+		return err;
+	path_put(path);
+	*path = next;
+	return 0;
+}
+
+static int p9_loop_walk(struct p9_loop *loop, struct p9_loop_pdu *in,
+			struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f;
+	struct path path;
+	u32 fid, newfid;
+	u16 nwname, i;
+	size_t nwqid_pos;
+	char *name;
+	int err = 0;
+
+	fid = pdu_u32(in);
+	newfid = pdu_u32(in);
+	nwname = pdu_u16(in);
+	if (in->err || nwname > P9_MAXWELEM)
+		return -EPROTO;
+	f = p9_loop_fid(loop, fid);
+	if (!f)
+		return -EBADF;
+	if (f->file)
+		return -EBUSY;
+	path = f->path;
+	path_get(&path);
+
+	nwqid_pos = out->pos;
+	put_u16(out, 0);
+	for (i = 0; i < nwname; i++) {
+		name = p9_loop_name(in);
+		if (IS_ERR(name)) {
+			err = PTR_ERR(name);
+			break;
+		}
+		err = p9_loop_walk_one(loop, &path, name);
+		kfree(name);
+		if (err)
+			break;
+		put_qid(out, path.dentry->d_inode);
+	}
+	/* a walk failing after the first name returns the qids it got */
+	if (err && i == 0)
+		goto out;
+	put_unaligned_le16(i, out->data + nwqid_pos);
+	err = 0;
+	if (i < nwname)
+		goto out;
+	if (newfid == fid) {
+		path_put(&f->path);
+		f->path = path;
+		return 0;
+	}
+	err = p9_loop_new_fid(loop, newfid, &path);
+ out:
+	path_put(&path);
+	return err;
+}
+
+static int p9_loop_getattr(struct p9_loop *loop, struct p9_loop_pdu *in,
+			   struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	struct kstat st;
+	int err;
+
+	if (!f)
+		return -EBADF;
+	err = vfs_getattr(&f->path, &st);
+	if (err)
+		return err;
+	put_u64(out, P9_STATS_BASIC);
+	put_u8(out, p9_loop_qid_type(st.mode));
+	put_u32(out, 0);
+	put_u64(out, st.ino);
+	put_u32(out, st.mode);
+	put_u32(out, from_kuid(&init_user_ns, st.uid));
+	put_u32(out, from_kgid(&init_user_ns, st.gid));
+	put_u64(out, st.nlink);
+	put_u64(out, huge_encode_dev(st.rdev));
+	put_u64(out, st.size);
+	put_u64(out, st.blksize);
+	put_u64(out, st.blocks);
+	put_u64(out, st.atime.tv_sec);
+	put_u64(out, st.atime.tv_nsec);
+	put_u64(out, st.mtime.tv_sec);
+	put_u64(out, st.mtime.tv_nsec);
+	put_u64(out, st.ctime.tv_sec);
+	put_u64(out, st.ctime.tv_nsec);
+	put_u64(out, 0);	/* btime */
+	put_u64(out, 0);
+	put_u64(out, 0);	/* gen */
+	put_u64(out, 0);	/* data_version */
+	return 0;
+}
+
+static int p9_loop_setattr(struct p9_loop *loop, struct p9_loop_pdu *in,
+			   struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	struct iattr attr = { 0 };
+	struct inode *inode;
+	u32 valid = pdu_u32(in), mode = pdu_u32(in);
+	u32 uid = pdu_u32(in), gid = pdu_u32(in);
+	u64 size = pdu_u64(in);
+	int err;
+
+	attr.ia_atime.tv_sec = pdu_u64(in);
+	attr.ia_atime.tv_nsec = pdu_u64(in);
+	attr.ia_mtime.tv_sec = pdu_u64(in);
+	attr.ia_mtime.tv_nsec = pdu_u64(in);
+	if (in->err)
+		return in->err;
+	if (!f)
+		return -EBADF;
+
+	if (valid & P9_ATTR_SIZE) {
+		err = vfs_truncate(&f->path, size);
+		if (err)
+			return err;
+	}
+	if (valid & P9_ATTR_MODE) {
+		attr.ia_valid |= ATTR_MODE;
+		attr.ia_mode = mode;
+	}
+	if (valid & P9_ATTR_UID) {
+		attr.ia_valid |= ATTR_UID;
+		attr.ia_uid = make_kuid(&init_user_ns, uid);
+	}
+	if (valid & P9_ATTR_GID) {
+		attr.ia_valid |= ATTR_GID;
+		attr.ia_gid = make_kgid(&init_user_ns, gid);
+	}
+	if (valid & P9_ATTR_ATIME)
+		attr.ia_valid |= ATTR_ATIME;
+	if (valid & P9_ATTR_ATIME_SET)
+		attr.ia_valid |= ATTR_ATIME_SET;
+	if (valid & P9_ATTR_MTIME)
+		attr.ia_valid |= ATTR_MTIME;
+	if (valid & P9_ATTR_MTIME_SET)
+		attr.ia_valid |= ATTR_MTIME_SET;
+	if (valid & P9_ATTR_CTIME)
+		attr.ia_valid |= ATTR_CTIME;
+	if (!attr.ia_valid)
+		return 0;
+
+	inode = f->path.dentry->d_inode;
+	mutex_lock(&inode->i_mutex);
+	err = notify_change(f->path.dentry, &attr, NULL);
+	mutex_unlock(&inode->i_mutex);
+	return err;
+}
+
+static int p9_loop_lopen(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	u32 flags = pdu_u32(in);
+	struct file *file;
+
+	if (!f)
+		return -EBADF;
+	if (f->file)
+		return -EBUSY;
+	file = dentry_open(&f->path,
+			   p9_loop_open_flags(flags) & ~(O_CREAT | O_EXCL),
+			   current_cred());
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	f->file = file;
+	put_qid(out, file_inode(file));
+	put_u32(out, 0);	/* iounit: up to the client */
+	return 0;
+}
+
+static int p9_loop_lcreate(struct p9_loop *loop, struct p9_loop_pdu *in,
+			   struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	char *name = p9_loop_name(in);
+	u32 flags = pdu_u32(in), mode = pdu_u32(in);
+	struct file *file;
+
+	/* gid is ignored */
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	file = ERR_PTR(-EBADF);
+	if (f && !f->file)
+		file = file_open_root(f->path.dentry, f->path.mnt, name,
+				      p9_loop_open_flags(flags) | O_CREAT,
+				      mode & S_IALLUGO);
+	kfree(name);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	/* the fid now names the new file, open */
+	path_put(&f->path);
+	f->path = file->f_path;
+	path_get(&f->path);
+	f->file = file;
+	put_qid(out, file_inode(file));
+	put_u32(out, 0);
+	return 0;
+}
+
+static int p9_loop_mkdir(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	char *name = p9_loop_name(in);
+	u32 mode = pdu_u32(in);
+	struct inode *dir;
+	struct dentry *dentry;
+	int err;
+
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	err = -EBADF;
+	if (!f)
+		goto out;
+	dir = f->path.dentry->d_inode;
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, f->path.dentry, strlen(name));
+	err = PTR_ERR(dentry);
+	if (IS_ERR(dentry))
+		goto out_unlock;
+	err = vfs_mkdir(dir, dentry, mode & S_IALLUGO);
+	if (!err)
+		put_qid(out, dentry->d_inode);
+	dput(dentry);
+ out_unlock:
+	mutex_unlock(&dir->i_mutex);
+ out:
+	kfree(name);
+	return err;
+}
+
+/*
+ * p9_loop_unlink - remove @name from directory @parent
+ */
+static int p9_loop_unlink(struct dentry *parent, const char *name,
+			  unsigned int len, bool rmdir)
+{
+	struct inode *dir = parent->d_inode;
+	struct dentry *dentry;
+	int err;
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, parent, len);
+	err = PTR_ERR(dentry);
+	if (IS_ERR(dentry))
+		goto out;
+	if (!dentry->d_inode)
+		err = -ENOENT;
+	else if (rmdir)
+		err = vfs_rmdir(dir, dentry);
+	else
+		err = vfs_unlink(dir, dentry, NULL);
+	dput(dentry);
+ out:
+	mutex_unlock(&dir->i_mutex);
+	return err;
+}
+
+static int p9_loop_unlinkat(struct p9_loop *loop, struct p9_loop_pdu *in,
+			    struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	char *name = p9_loop_name(in);
+	u32 flags = pdu_u32(in);
+	int err = -EBADF;
+
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	if (f)
+		err = p9_loop_unlink(f->path.dentry, name, strlen(name),
+				     flags & P9_LOOP_AT_REMOVEDIR);
+	kfree(name);
+	return err;
+}
+
+static int p9_loop_remove(struct p9_loop *loop, struct p9_loop_pdu *in,
+			  struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	struct dentry *dentry, *parent;
+	int err;
+
+	if (!f)
+		return -EBADF;
+	dentry = f->path.dentry;
+	parent = dget_parent(dentry);
+	err = p9_loop_unlink(parent, dentry->d_name.name, dentry->d_name.len,
+			     S_ISDIR(dentry->d_inode->i_mode));
+	dput(parent);
+	/* the fid is clunked even if the remove failed */
+	p9_loop_put_fid(loop, f);
+	return err;
+}
+
+static int p9_loop_read(struct p9_loop *loop, struct p9_loop_pdu *in,
+			struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	u64 offset = pdu_u64(in);
+	u32 count = pdu_u32(in);
+	int ret;
+
+	if (!f || !f->file)
+		return -EBADF;
+	count = min_t(u32, count, out->size - out->pos - 4);
+	ret = kernel_read(f->file, offset, out->data + out->pos + 4, count);
+	if (ret < 0)
+		return ret;
+	put_u32(out, ret);
+	out->pos += ret;
+	return 0;
+}
+
+static int p9_loop_write(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	u64 offset = pdu_u64(in);
+	u32 count = pdu_u32(in);
+	char *data = pdu_take(in, count);
+	ssize_t ret;
+
+	if (!data)
+		return -EPROTO;
+	if (!f || !f->file)
+		return -EBADF;
+	ret = kernel_write(f->file, data, count, offset);
+	if (ret < 0)
+		return ret;
+	put_u32(out, ret);
+	return 0;
+}
+
+/*
+ * Treaddir: each entry carries the offset to resume after it, which is
+ * the position of the next entry, so it is filled in when the next entry
+ * (or the end of the directory) is reached
+ */
+struct p9_loop_readdir {
+	struct dir_context	ctx;
+	struct p9_loop_pdu	*out;
+	size_t			end;
+	char			*last_offset;
+};
+
+static int p9_loop_filldir(struct dir_context *ctx, const char *name,
+			   int namlen, loff_t offset, u64 ino,
+			   unsigned int d_type)
+{
+	struct p9_loop_readdir *rd =
+		container_of(ctx, struct p9_loop_readdir, ctx);
+	struct p9_loop_pdu *out = rd->out;
+
+	if (out->pos + 13 + 8 + 1 + 2 + namlen > rd->end)
+		return -ENOSPC;
+	if (rd->last_offset)
+		put_unaligned_le64(offset, rd->last_offset);
+	put_u8(out, d_type == DT_DIR ? P9_QTDIR :
+		    d_type == DT_LNK ? P9_QTSYMLINK : P9_QTFILE);
+	put_u32(out, 0);
+	put_u64(out, ino);
+	rd->last_offset = out->data + out->pos;
+	put_u64(out, 0);
+	put_u8(out, d_type);
+	put_str(out, name, namlen);
+	return 0;
+}
+
+static int p9_loop_readdir(struct p9_loop *loop, struct p9_loop_pdu *in,
+			   struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	u64 offset = pdu_u64(in);
+	u32 count = pdu_u32(in);
+	struct p9_loop_readdir rd = {
+		.ctx.actor = p9_loop_filldir,
+		.out = out,
+	};
+	size_t count_pos = out->pos;
+	loff_t pos;
+	int err;
+
+	if (!f || !f->file)
+		return -EBADF;
+	put_u32(out, 0);
+	rd.end = out->pos + min_t(size_t, count, out->size - out->pos);
+	pos = vfs_llseek(f->file, offset, SEEK_SET);
+	if (pos < 0)
+		return pos;
+	err = iterate_dir(f->file, &rd.ctx);
+	if (err)
+		return err;
+	if (rd.last_offset)
+		put_unaligned_le64(f->file->f_pos, rd.last_offset);
+	put_unaligned_le32(out->pos - count_pos - 4, out->data + count_pos);
+	return 0;
+}
+
+static int p9_loop_clunk(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+
+	if (!f)
+		return -EBADF;
+	p9_loop_put_fid(loop, f);
+	return 0;
+}
+
+static int p9_loop_statfs(struct p9_loop *loop, struct p9_loop_pdu *in,
+			  struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	struct kstatfs st;
+	int err;
+
+	if (!f)
+		return -EBADF;
+	err = vfs_statfs(&f->path, &st);
+	if (err)
+		return err;
+	put_u32(out, st.f_type);
+	put_u32(out, st.f_bsize);
+	put_u64(out, st.f_blocks);
+	put_u64(out, st.f_bfree);
+	put_u64(out, st.f_bavail);
+	put_u64(out, st.f_files);
+	put_u64(out, st.f_ffree);
+	put_u64(out, (u64) st.f_fsid.val[0] | (u64) st.f_fsid.val[1] << 32);
+	put_u32(out, st.f_namelen);
+	return 0;
+}
+
+static int p9_loop_fsync(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	struct p9_loop_fid *f = p9_loop_fid(loop, pdu_u32(in));
+	u32 datasync = pdu_u32(in);
+
+	if (!f || !f->file)
+		return -EBADF;
+	return vfs_fsync(f->file, datasync);
+}
+
+/* requests are served in order, so there is never one left to flush */
+static int p9_loop_flush(struct p9_loop *loop, struct p9_loop_pdu *in,
+			 struct p9_loop_pdu *out)
+{
+	return 0;
+}
+
+static int (*const p9_loop_ops[])(struct p9_loop *loop,
+				  struct p9_loop_pdu *in,
+				  struct p9_loop_pdu *out) = {
+	[P9_TSTATFS] = p9_loop_statfs,
+	[P9_TLOPEN] = p9_loop_lopen,
+	[P9_TLCREATE] = p9_loop_lcreate,
+	[P9_TGETATTR] = p9_loop_getattr,
+	[P9_TSETATTR] = p9_loop_setattr,
+	[P9_TREADDIR] = p9_loop_readdir,
+	[P9_TFSYNC] = p9_loop_fsync,
+	[P9_TMKDIR] = p9_loop_mkdir,
+	[P9_TUNLINKAT] = p9_loop_unlinkat,
+	[P9_TVERSION] = p9_loop_version,
+	[P9_TATTACH] = p9_loop_attach,
+	[P9_TFLUSH] = p9_loop_flush,
+	[P9_TWALK] = p9_loop_walk,
+	[P9_TREAD] = p9_loop_read,
+	[P9_TWRITE] = p9_loop_write,
+	[P9_TCLUNK] = p9_loop_clunk,
+	[P9_TREMOVE] = p9_loop_remove,
+};
+
+/*
+ * p9_loop_serve - answer one request
+ *
+ * Returns the status for the response: P9_RSP_ERROR if the request could
+ * not be read or the reply not written, otherwise P9_RSP_OKAY with the
+ * reply, Rlerror included, in the reply room.
+ */
+static int16_t p9_loop_serve(struct p9_loop_queue *lq, p9_request_t *req)
+{
+	struct p9_loop *loop = lq->loop;
+	struct p9_loop_pdu in, out;
+	int len, err;
+	u8 type;
+
+	len = p9_loop_xfer(lq, req, true, lq->msg, P9_LOOP_MAX_MSG);
+	if (len < P9_LOOP_HDR)
+		return P9_RSP_ERROR;
+	type = lq->msg[4];
+	in = (struct p9_loop_pdu) {
+		.data = lq->msg, .size = len, .pos = P9_LOOP_HDR,
+	};
+	out = (struct p9_loop_pdu) {
+		.data = lq->reply, .size = P9_LOOP_MAX_MSG, .pos = P9_LOOP_HDR,
+	};
+
+	err = -EOPNOTSUPP;
+	if (type < ARRAY_SIZE(p9_loop_ops) && p9_loop_ops[type])
+		err = p9_loop_ops[type](loop, &in, &out);
+	if (!err && (in.err || out.err))
+		err = -EPROTO;
+	if (err) {
+		out.pos = P9_LOOP_HDR;
+		out.err = 0;
+		put_u32(&out, -err);
+		type = P9_RLERROR;
+	} else {
+		type++;
+	}
+	put_unaligned_le32(out.pos, out.data);
+	out.data[4] = type;
+	put_unaligned_le16(req->tag, out.data + 5);
+
+	if (p9_loop_xfer(lq, req, false, out.data, out.pos) < 0)
+		return P9_RSP_ERROR;
+	return P9_RSP_OKAY;
+}
+
+/*
+ * p9_loop_work - serve the requests on a ring, as a Xen backend would:
+ *                push each response as it is ready, and ask for an event
+ *                before going idle
+ */
+static void p9_loop_work(struct work_struct *work)
+{
+	struct p9_loop_queue *lq = container_of(work, struct p9_loop_queue,
+						work);
+	struct p9_back_ring *ring = &lq->ring;
+	p9_response_t *rsp;
+	p9_request_t req;
+	RING_IDX rc, rp;
+	int more, notify;
+
+	do {
+		rc = ring->req_cons;
+		rp = ring->sring->req_prod;
+		rmb();		/* Ensure we see queued requests up to 'rp'. */
+		while (rc != rp) {
+			/* the response reuses the slot of the request */
+			req = *RING_GET_REQUEST(ring, rc);
+			ring->req_cons = ++rc;
+
+			rsp = RING_GET_RESPONSE(ring, ring->rsp_prod_pvt);
+			rsp->status = p9_loop_serve(lq, &req);
+			rsp->id = req.id;
+			rsp->tag = req.tag;
+			ring->rsp_prod_pvt++;
+			RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(ring, notify);
+			if (notify)
+				p9front_event(lq->front);
+		}
+		RING_FINAL_CHECK_FOR_REQUESTS(ring, more);
+	} while (more);
+}
+
+static void p9_loop_free(struct p9_loop *loop)
+{
+	struct p9_front_info *info = loop->info;
+	unsigned int i;
+
+	if (loop->wq)
+		destroy_workqueue(loop->wq);
+	/* the module is only unloaded with no mount left on the channel */
+	if (info)
+		p9front_remove(info);
+	for (i = 0; i < loop->nr_queues; i++) {
+		vfree(loop->queues[i].msg);
+		vfree(loop->queues[i].reply);
+	}
+	kfree(loop->queues);
+	p9_loop_put_fids(loop);
+	if (loop->root.dentry)
+		path_put(&loop->root);
+	idr_destroy(&loop->grants);
+	kfree(loop);
+}
+
+/*
+ * p9_loop_create - set up the device and channel, as p9_xen_probe and
+ *                  p9front_connect do for a xenbus device
+ */
+static int p9_loop_create(struct p9_loop *loop)
+{
+	struct p9_front_info *info;
+	struct xen9p_chan *chan;
+	unsigned int i;
+	int err;
+
+	chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+	info = kzalloc(sizeof(*info), GFP_KERNEL);
+	if (chan)
+		chan->tag = kstrdup(p9_loop_tag, GFP_KERNEL);
+	if (chan)
+		chan->vc_wq = kmalloc(sizeof(wait_queue_head_t), GFP_KERNEL);
+	if (!info || !chan || !chan->tag || !chan->vc_wq) {
+		if (chan) {
+			kfree(chan->tag);
+			kfree(chan->vc_wq);
+		}
+		kfree(chan);
+		kfree(info);
+		return -ENOMEM;
+	}
+	err = p9front_init_info(info, chan);
+	if (err) {
+		kfree(chan->tag);
+		kfree(chan->vc_wq);
+		kfree(chan);
+		kfree(info);
+		return err;
+	}
+	chan->tag_len = strlen(chan->tag);
+	init_waitqueue_head(chan->vc_wq);
+	sg_init_table(chan->sg, NUM_P9_SGLISTS);
+	chan->p9_max_pages = nr_free_buffer_pages() / 4;
+
+	info->loop = loop;
+	info->latency = vzalloc(sizeof(*info->latency));
+	/* the backend's buffers bound the messages it takes */
+	info->max_request_size = P9_LOOP_MAX_MSG;
+	loop->info = info;
+	if (!info->latency)
+		return -ENOMEM;
+
+	err = p9front_loop_attach(info, num_online_cpus());
+	if (err)
+		return err;
+
+	loop->queues = kcalloc(info->nr_queues, sizeof(*loop->queues),
+			       GFP_KERNEL);
+	if (!loop->queues)
+		return -ENOMEM;
+	loop->nr_queues = info->nr_queues;
+	for (i = 0; i < loop->nr_queues; i++) {
+		struct p9_loop_queue *lq = &loop->queues[i];
+
+		lq->loop = loop;
+		lq->front = &info->queues[i];
+		BACK_RING_INIT(&lq->ring, lq->front->ring.sring,
+			       info->nr_ring_pages * PAGE_SIZE);
+		INIT_WORK(&lq->work, p9_loop_work);
+		lq->msg = vmalloc(P9_LOOP_MAX_MSG);
+		lq->reply = vmalloc(P9_LOOP_MAX_MSG);
+		if (!lq->msg || !lq->reply)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * p9_loop_init - create the loopback device, if loopback_dir is set
+ */
+int p9_loop_init(void)
+{
+	struct p9_loop *loop;
+	int err;
+
+	if (!p9_loop_dir)
+		return 0;
+	loop = kzalloc(sizeof(*loop), GFP_KERNEL);
+	if (!loop)
+		return -ENOMEM;
+	spin_lock_init(&loop->grant_lock);
+	idr_init(&loop->grants);
+	mutex_init(&loop->fid_lock);
+	hash_init(loop->fids);
+
+	err = kern_path(p9_loop_dir, LOOKUP_FOLLOW | LOOKUP_DIRECTORY,
+			&loop->root);
+	if (err) {
+		loop->root.dentry = NULL;
+		pr_err("p9front: loopback_dir %s: error %d\n", p9_loop_dir,
+		       err);
+		goto fail;
+	}
+	err = -ENOMEM;
+	loop->wq = alloc_workqueue("p9loop", WQ_UNBOUND, 0);
+	if (!loop->wq)
+		goto fail;
+	err = p9_loop_create(loop);
+	if (err)
+		goto fail;
+
+	p9_xen_add_chan(loop->info->chan);
+	p9front_debugfs_add(loop->info);
+	p9_loop_dev = loop;
+	printk(KERN_INFO "p9front: loopback device %s serving %s, %u queue(s)\n",
+	       p9_loop_tag, p9_loop_dir, loop->nr_queues);
+	return 0;
+ fail:
+	p9_loop_free(loop);
+	return err;
+}
+
+void p9_loop_exit(void)
+{
+	struct p9_loop *loop = p9_loop_dev;
+
+	if (!loop)
+		return;
+	p9_loop_dev = NULL;
+	p9_xen_del_chan(loop->info->chan);
+	p9front_debugfs_remove(loop->info);
+	p9_loop_free(loop);
+}
@@ -0,0 +1,291 @@
+/*
+ * Request packing of the Xen 9p transport front end
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  How a 9p message and the room for its reply are laid out in a request
+ *  (see p9.h): in a slot of a shared data page, in the data rings, or in
+ *  pool pages named by indirect segments, and where the reply is found
+ *  again.  Shared by p9_front.c and the userspace simulator in sim/, so
+ *  both build requests the same way; the pages, grants and locking are
+ *  the caller's.  Include after p9.h.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#ifndef __P9_PACK_H__
+#define __P9_PACK_H__
+
+/*
+ * direct requests take slots of P9_MIN_SLOT << class bytes of a data page;
+ * a page has at most BITS_PER_LONG of them, the width of its free mask,
+ * so the smallest slot is 256 bytes or, on large pages, whatever keeps a
+ * page at BITS_PER_LONG slots
+ */
+#define P9_MIN_SLOT_SHIFT	(PAGE_SHIFT - ilog2(BITS_PER_LONG) > 8 ? \
+				 PAGE_SHIFT - ilog2(BITS_PER_LONG) : 8)
+#define P9_MIN_SLOT		(1U << P9_MIN_SLOT_SHIFT)
+#define P9_NR_SLOT_CLASSES	(PAGE_SHIFT - P9_MIN_SLOT_SHIFT + 1)
+
+/* every slot of a page of class _class free */
+#define P9_SLOTS_MASK(_class) \
+	(~0UL >> (BITS_PER_LONG - PAGE_SIZE / (P9_MIN_SLOT << (_class))))
+
+/* spans of the data rings are handed out in multiples of this */
+#define P9_DATA_RING_ALIGN	64
+
+/* indirect pages holding _segs segments */
+#define P9_INDIRECT_PAGES(_segs) \
+	(((_segs) + P9_SEGS_PER_INDIRECT_FRAME - 1) / P9_SEGS_PER_INDIRECT_FRAME)
+
+/*
+ * how a request carries its message and reply, chosen by p9_pack_plan
+ */
+enum p9_pack_kind {
+	P9_PACK_SLOT,		/* direct, in a slot of a shared data page */
+	P9_PACK_DATA_RING,	/* direct, in the data rings */
+	P9_PACK_INDIRECT,	/* in pool pages, one segment each */
+};
+
+/*
+ * struct p9_pack - the layout of a request
+ * @kind: see enum p9_pack_kind
+ * @nr_msg_segs, @nr_reply_segs: pool pages for the message and for the
+ *        reply; indirect only
+ * @nr_pages: pool pages to take, the indirect pages last; indirect only
+ */
+struct p9_pack {
+	enum p9_pack_kind	kind;
+	unsigned int		nr_msg_segs;
+	unsigned int		nr_reply_segs;
+	unsigned int		nr_pages;
+};
+
+/*
+ * p9_data_ring_fits - whether a request can go through data rings of
+ *                     @ring_size bytes each (0 when there are none): the
+ *                     message and the reply each take at most half of its
+ *                     ring, and the zero copy pages fit in the request
+ */
+static inline int p9_data_ring_fits(unsigned int ring_size,
+				    unsigned int out_len, unsigned int in_len,
+				    unsigned int nr_zc_segs)
+{
+	unsigned int half = ring_size / 2;
+
+	return out_len <= half && in_len <= half &&
+	       nr_zc_segs <= P9_MAX_SEGMENTS_PER_REQUEST;
+}
+
+/*
+ * p9_pack_plan - lay out a request of @out_len bytes with room for
+ *                @in_len bytes of reply and @nr_zc_segs zero copy pages
+ *
+ * The data rings are used when the request fits in them, then a slot when
+ * the message and the reply share a page and the zero copy pages fit in
+ * the request, else indirect segments.  Returns -E2BIG when that takes
+ * more than @max_indirect_segments.
+ */
+static inline int p9_pack_plan(struct p9_pack *pack, unsigned int out_len,
+			       unsigned int in_len, unsigned int nr_zc_segs,
+			       unsigned int data_ring_size,
+			       unsigned int max_indirect_segments)
+{
+	unsigned int n;
+
+	pack->nr_msg_segs = pack->nr_reply_segs = pack->nr_pages = 0;
+	if (p9_data_ring_fits(data_ring_size, out_len, in_len, nr_zc_segs)) {
+		pack->kind = P9_PACK_DATA_RING;
+		return 0;
+	}
+	if (!p9_request_is_indirect(out_len, in_len, nr_zc_segs)) {
+		pack->kind = P9_PACK_SLOT;
+		return 0;
+	}
+	pack->kind = P9_PACK_INDIRECT;
+	pack->nr_msg_segs = (out_len + PAGE_SIZE - 1) / PAGE_SIZE;
+	pack->nr_reply_segs = (in_len + PAGE_SIZE - 1) / PAGE_SIZE;
+	n = pack->nr_msg_segs + pack->nr_reply_segs + nr_zc_segs;
+	if (n > max_indirect_segments)
+		return -E2BIG;
+	pack->nr_pages = pack->nr_msg_segs + pack->nr_reply_segs +
+			 P9_INDIRECT_PAGES(n);
+	return 0;
+}
+
+/*
+ * p9_slot_class - the size class of the slot for @size bytes
+ */
+static inline unsigned int p9_slot_class(unsigned int size)
+{
+	unsigned int class = 0;
+
+	while ((P9_MIN_SLOT << class) < size)
+		class++;
+	return class;
+}
+
+/*
+ * p9_slot_take - take a slot of class @class from the free mask of its
+ *                page, which must have one; returns its offset
+ */
+static inline unsigned int p9_slot_take(unsigned long *slot_free,
+					unsigned int class)
+{
+	unsigned int slot = __ffs(*slot_free);
+
+	*slot_free &= ~(1UL << slot);
+	return slot * (P9_MIN_SLOT << class);
+}
+
+/*
+ * p9_slot_put - give back the slot at @offset of a page of class @class;
+ *               returns nonzero if every slot of the page is free again
+ */
+static inline int p9_slot_put(unsigned long *slot_free, unsigned int class,
+			      unsigned int offset)
+{
+	*slot_free |= 1UL << (offset / (P9_MIN_SLOT << class));
+	return *slot_free == P9_SLOTS_MASK(class);
+}
+
+/*
+ * p9_data_span_get - take a span of @len bytes of a data ring of @size
+ *                    bytes, whose free running counters are *@prod and
+ *                    @cons; returns its offset or -ENOSPC
+ *
+ * Spans do not wrap: when one does not fit before the end of the ring,
+ * the bytes up to the end are skipped and given back along with it.
+ */
+static inline int p9_data_span_get(uint32_t *prod, uint32_t cons,
+				   unsigned int size, unsigned int len)
+{
+	unsigned int pos = *prod & (size - 1), skip = 0;
+
+	len = (len + P9_DATA_RING_ALIGN - 1) & ~(P9_DATA_RING_ALIGN - 1);
+	if (pos + len > size)
+		skip = size - pos;
+	if (*prod + skip + len - cons > size)
+		return -ENOSPC;
+	*prod += skip + len;
+	return (pos + skip) & (size - 1);
+}
+
+/*
+ * struct p9_data_span - what a request took of the data rings of its queue
+ * @out_end, @in_end: prod of each ring after it took its spans
+ * @done: its response has arrived; the rings only get the spans back once
+ *        those of every earlier request are done too
+ */
+struct p9_data_span {
+	uint32_t		out_end;
+	uint32_t		in_end;
+	bool			done;
+};
+
+/*
+ * p9_data_spans_put - mark span @span done and give the data rings back
+ *                     what the done spans from *@tail on hold
+ * @spans: @mask + 1 entries, a power of 2, indexed by a free running count
+ * @head: the count of the next span to be taken
+ * @out_cons, @in_cons: cons of the out and in data rings
+ */
+static inline void p9_data_spans_put(struct p9_data_span *spans,
+				     unsigned int mask, unsigned int span,
+				     unsigned int *tail, unsigned int head,
+				     uint32_t *out_cons, uint32_t *in_cons)
+{
+	struct p9_data_span *s;
+
+	spans[span & mask].done = true;
+	while (*tail != head) {
+		s = &spans[*tail & mask];
+		if (!s->done)
+			break;
+		*out_cons = s->out_end;
+		*in_cons = s->in_end;
+		(*tail)++;
+	}
+}
+
+/*
+ * p9_pack_direct - a direct request: the message at @offset of the page
+ *                  of @gref followed by the room for the reply, @nrbytes
+ *                  in all; or, when @gref is P9_DATA_RING_REF, the message
+ *                  at @offset of the out data ring and the reply room at
+ *                  @nrbytes of the in data ring
+ */
+static inline void p9_pack_direct(p9_request_t *req, grant_ref_t gref,
+				  uint32_t offset, uint32_t nrbytes)
+{
+	req->gref = gref;
+	req->offset = offset;
+	req->nrbytes = nrbytes;
+}
+
+/*
+ * p9_pack_indirect - an indirect request, with its segments in the @nr
+ *                    pages of @grefs
+ */
+static inline void p9_pack_indirect(p9_request_t *req,
+				    const grant_ref_t *grefs, unsigned int nr)
+{
+	unsigned int i;
+
+	req->gref = 0;		/* unused, as are offset and nrbytes */
+	req->offset = 0;
+	req->nrbytes = 0;
+	req->nr_segments = P9_SEGMENTS_INDIRECT;
+	for (i = 0; i < nr; i++)
+		req->indirect.indirect_grefs[i] = grefs[i];
+}
+
+/*
+ * p9_pack_page - describe one pool page of a message or reply as @seg,
+ *                copying what of @data goes in it (NULL for reply pages);
+ *                returns the bytes of the @len left that the page takes
+ */
+static inline unsigned int p9_pack_page(struct p9_request_segment *seg,
+					grant_ref_t gref, char *page,
+					const char *data, unsigned int len)
+{
+	unsigned int nrbytes = len < PAGE_SIZE ? len : PAGE_SIZE;
+
+	if (data)
+		memcpy(page, data, nrbytes);
+	seg->gref = gref;
+	seg->offset = 0;
+	seg->nrbytes = nrbytes;
+	return nrbytes;
+}
+
+/*
+ * p9_pack_segments - record that the request has @nr_segs segments, the
+ *                    first @nr_out_segs of them read by the backend
+ */
+static inline void p9_pack_segments(p9_request_t *req, unsigned int nr_segs,
+				    unsigned int nr_out_segs)
+{
+	if (req->nr_segments == P9_SEGMENTS_INDIRECT) {
+		req->indirect.nr_segments = nr_segs;
+		req->indirect.nr_out_segments = nr_out_segs;
+	} else {
+		req->nr_segments = nr_segs;
+		req->nr_out_segments = nr_out_segs;
+	}
+}
+
+/*
+ * p9_reply_len - bytes of the reply at @reply to copy out: its own size,
+ *                but no more than the @in_len reserved for it
+ */
+static inline unsigned int p9_reply_len(const char *reply, unsigned int in_len)
+{
+	uint32_t size = le32_to_cpu(*(const __le32 *) reply);
+
+	return size < in_len ? size : in_len;
+}
+
+#endif /* __P9_PACK_H__ */
@@ -0,0 +1,138 @@
+/*
+ * Ring logic of the Xen 9p transport front end
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  The parts of the front end that only deal with the shared ring laid
+ *  out by DEFINE_RING_TYPES(p9, ...) in p9.h: request ids, putting
+ *  requests on the ring and taking responses off it.  They are shared by
+ *  p9_front.c and the userspace simulator in sim/, so the ring protocol
+ *  can be exercised and benchmarked without a Xen host.
+ *
+ *  Nothing here takes a lock; callers serialise access to a ring
+ *  themselves (ring_lock in the front end).  Include after p9.h.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#ifndef __P9_RING_H__
+#define __P9_RING_H__
+
+/*
+ * req.id of an entry taken off the free list, until the request is built
+ */
+#define P9_ID_IN_USE	0x0fffffee
+
+/*
+ * Request ids index a shadow array, whose entries have a p9_request_t
+ * req.  Free ids are chained through the req.id of their entries,
+ * starting at *(_free); an id of (_size) or more ends the chain.  Taking
+ * and returning an id are O(1).
+ */
+#define P9_FREELIST_INIT(_shadow, _size, _free) do {			\
+	unsigned int __i;						\
+	for (__i = 0; __i < (_size); __i++)				\
+		(_shadow)[__i].req.id = __i + 1;			\
+	*(_free) = 0;							\
+} while (0)
+
+/* evaluates to a free id, or -ENOSPC when every id is in use */
+#define P9_FREELIST_GET(_shadow, _size, _free) ({			\
+	unsigned long __id = *(_free);					\
+	long __ret = -ENOSPC;						\
+	if (__id < (_size)) {						\
+		*(_free) = (_shadow)[__id].req.id;			\
+		(_shadow)[__id].req.id = P9_ID_IN_USE;			\
+		__ret = __id;						\
+	}								\
+	__ret;								\
+})
+
+/* clears the entry of @_id and puts the id back on the free list */
+#define P9_FREELIST_PUT(_shadow, _free, _id) do {			\
+	memset(&(_shadow)[_id], 0, sizeof((_shadow)[_id]));		\
+	(_shadow)[_id].req.id = *(_free);				\
+	*(_free) = (_id);						\
+} while (0)
+
+/*
+ * p9_request_is_indirect - whether a request needs indirect segments
+ *
+ * A direct request carries its message and the room for its reply in
+ * one data page, and its zero copy pages in req.seg.
+ */
+static inline int p9_request_is_indirect(unsigned int out_len,
+					 unsigned int in_len,
+					 unsigned int nr_zc_segs)
+{
+	return out_len + in_len > PAGE_SIZE ||
+	       nr_zc_segs > P9_MAX_SEGMENTS_PER_REQUEST;
+}
+
+/*
+ * p9_ring_put_request - copy a built request into the next free slot of
+ *                       the ring; it is not seen by the backend until
+ *                       p9_ring_push.  The ring must not be full.
+ */
+static inline void p9_ring_put_request(struct p9_front_ring *ring,
+				       const p9_request_t *req)
+{
+	*RING_GET_REQUEST(ring, ring->req_prod_pvt) = *req;
+	ring->req_prod_pvt++;
+}
+
+/*
+ * p9_ring_push - publish the requests put on the ring
+ *
+ * Returns nonzero if the backend has to be sent an event; it is not when
+ * it is still working through the requests published earlier.
+ */
+static inline int p9_ring_push(struct p9_front_ring *ring)
+{
+	int notify;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(ring, notify);
+	return notify;
+}
+
+/*
+ * p9_ring_rsp_prod - the index up to which responses can be taken off the
+ *                    ring, from rsp_cons
+ */
+static inline RING_IDX p9_ring_rsp_prod(struct p9_front_ring *ring)
+{
+	RING_IDX rp = ring->sring->rsp_prod;
+
+	rmb();			/* Ensure we see queued responses up to 'rp'. */
+	return rp;
+}
+
+/*
+ * p9_ring_finish_responses - move rsp_cons to @cons, after the responses
+ *                            up to it were taken off the ring
+ *
+ * @rp - what p9_ring_rsp_prod returned; @cons stops short of it when the
+ *       caller ran out of budget
+ *
+ * Returns nonzero if there are responses left to take.  Otherwise asks for
+ * an event with the next response, unless no request is outstanding: then
+ * the event for the next response is requested when a request is pushed.
+ */
+static inline int p9_ring_finish_responses(struct p9_front_ring *ring,
+					   RING_IDX cons, RING_IDX rp)
+{
+	int more_to_do = 0;
+
+	ring->rsp_cons = cons;
+	if (cons != rp)
+		more_to_do = 1;
+	else if (cons != ring->req_prod_pvt)
+		RING_FINAL_CHECK_FOR_RESPONSES(ring, more_to_do);
+	else
+		ring->sring->rsp_event = cons + 1;
+	return more_to_do;
+}
+
+#endif /* __P9_RING_H__ */
@@ -0,0 +1,169 @@
+/*
+ * Tracepoints for the Xen 9p transport front end
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  The lifecycle of a request: p9front_submit when it is written to the
+ *  ring, p9front_doorbell when the ring is pushed, p9front_interrupt when
+ *  the backend signals, p9front_response when its response is taken off
+ *  the ring and p9front_client_cb once the 9p client has been told.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM p9front
+
+#if !defined(_P9FRONT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _P9FRONT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(p9front_submit,
+
+	TP_PROTO(unsigned int queue, unsigned int idx, unsigned long id,
+		 u16 tag, u8 type, unsigned int out_len, unsigned int in_len,
+		 unsigned int nr_segs, bool indirect),
+
+	TP_ARGS(queue, idx, id, tag, type, out_len, in_len, nr_segs, indirect),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, queue)
+		__field(unsigned int, idx)
+		__field(unsigned long, id)
+		__field(u16, tag)
+		__field(u8, type)
+		__field(unsigned int, out_len)
+		__field(unsigned int, in_len)
+		__field(unsigned int, nr_segs)
+		__field(bool, indirect)
+	),
+
+	TP_fast_assign(
+		__entry->queue = queue;
+		__entry->idx = idx;
+		__entry->id = id;
+		__entry->tag = tag;
+		__entry->type = type;
+		__entry->out_len = out_len;
+		__entry->in_len = in_len;
+		__entry->nr_segs = nr_segs;
+		__entry->indirect = indirect;
+	),
+
+	TP_printk("queue=%u idx=%u id=%lu tag=%u type=%u out_len=%u in_len=%u nr_segs=%u%s",
+		  __entry->queue, __entry->idx, __entry->id, __entry->tag,
+		  __entry->type, __entry->out_len, __entry->in_len,
+		  __entry->nr_segs, __entry->indirect ? " indirect" : "")
+);
+
+TRACE_EVENT(p9front_doorbell,
+
+	TP_PROTO(unsigned int queue, unsigned int req_prod, int notify),
+
+	TP_ARGS(queue, req_prod, notify),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, queue)
+		__field(unsigned int, req_prod)
+		__field(int, notify)
+	),
+
+	TP_fast_assign(
+		__entry->queue = queue;
+		__entry->req_prod = req_prod;
+		__entry->notify = notify;
+	),
+
+	TP_printk("queue=%u req_prod=%u%s",
+		  __entry->queue, __entry->req_prod,
+		  __entry->notify ? " notify" : "")
+);
+
+TRACE_EVENT(p9front_interrupt,
+
+	TP_PROTO(unsigned int queue, unsigned int rsp_prod,
+		 unsigned int rsp_cons),
+
+	TP_ARGS(queue, rsp_prod, rsp_cons),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, queue)
+		__field(unsigned int, rsp_prod)
+		__field(unsigned int, rsp_cons)
+	),
+
+	TP_fast_assign(
+		__entry->queue = queue;
+		__entry->rsp_prod = rsp_prod;
+		__entry->rsp_cons = rsp_cons;
+	),
+
+	TP_printk("queue=%u rsp_prod=%u rsp_cons=%u",
+		  __entry->queue, __entry->rsp_prod, __entry->rsp_cons)
+);
+
+TRACE_EVENT(p9front_response,
+
+	TP_PROTO(unsigned int queue, unsigned int idx, unsigned long id,
+		 u16 tag, s16 status, s64 service_us),
+
+	TP_ARGS(queue, idx, id, tag, status, service_us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, queue)
+		__field(unsigned int, idx)
+		__field(unsigned long, id)
+		__field(u16, tag)
+		__field(s16, status)
+		__field(s64, service_us)
+	),
+
+	TP_fast_assign(
+		__entry->queue = queue;
+		__entry->idx = idx;
+		__entry->id = id;
+		__entry->tag = tag;
+		__entry->status = status;
+		__entry->service_us = service_us;
+	),
+
+	TP_printk("queue=%u idx=%u id=%lu tag=%u status=%d service=%lldus",
+		  __entry->queue, __entry->idx, __entry->id, __entry->tag,
+		  __entry->status, __entry->service_us)
+);
+
+TRACE_EVENT(p9front_client_cb,
+
+	TP_PROTO(unsigned int queue, u16 tag, u8 type, s64 total_us),
+
+	TP_ARGS(queue, tag, type, total_us),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, queue)
+		__field(u16, tag)
+		__field(u8, type)
+		__field(s64, total_us)
+	),
+
+	TP_fast_assign(
+		__entry->queue = queue;
+		__entry->tag = tag;
+		__entry->type = type;
+		__entry->total_us = total_us;
+	),
+
+	TP_printk("queue=%u tag=%u type=%u total=%lldus",
+		  __entry->queue, __entry->tag, __entry->type,
+		  __entry->total_us)
+);
+
+#endif /* _P9FRONT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE p9front_trace
+#include <trace/define_trace.h>
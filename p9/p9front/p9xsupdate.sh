@@ -1,27 +1,51 @@
 #!/bin/sh
+# p9xsupdate.sh domid [tag ...]
+#
+# Create the xenstore entries of p9 devices for domain domid: device 0
+# with no mount tag, or one device per tag, numbered from 0, each with
+# its own rings.  Mount them in the guest with
+#   mount -t 9p -o trans=xen tag /mnt/point
+dom=$1
+shift
+[ $# -eq 0 ] && set -- ""
+
 sudo xenstore-write /local/domain/0/backend/p9 ""
 sudo xenstore-chmod /local/domain/0/backend/p9 n0
-sudo  xenstore-write /local/domain/0/backend/p9/$1 ""
-sudo xenstore-chmod /local/domain/0/backend/p9/$1 n0
-sudo xenstore-write /local/domain/0/backend/p9/$1/0 ""
-sudo xenstore-chmod /local/domain/0/backend/p9/$1/0 n0 r$1
-sudo xenstore-write /local/domain/0/backend/p9/$1/0/frontend "/local/domain/$1/device/p9/0"
-sudo xenstore-chmod /local/domain/0/backend/p9/$1/0/frontend n0 r$1
-sudo xenstore-write /local/domain/0/backend/p9/$1/0/frontend-id "$1"
-sudo xenstore-chmod /local/domain/0/backend/p9/$1/0/frontend-id n0 r$1
-sudo xenstore-write /local/domain/0/backend/p9/$1/0/online "$1"
-sudo xenstore-chmod /local/domain/0/backend/p9/$1/0/online n0 r$1
-sudo xenstore-write /local/domain/0/backend/p9/$1/0/state "1"
-sudo xenstore-chmod /local/domain/0/backend/p9/$1/0/state n0 r$1
+sudo  xenstore-write /local/domain/0/backend/p9/$dom ""
+sudo xenstore-chmod /local/domain/0/backend/p9/$dom n0
+sudo xenstore-write /local/domain/$dom/device/p9  ""
+sudo xenstore-chmod /local/domain/$dom/device/p9 n0 r$dom
+
+dev=0
+for tag in "$@"; do
+	back=/local/domain/0/backend/p9/$dom/$dev
+	front=/local/domain/$dom/device/p9/$dev
 
-sudo xenstore-write /local/domain/$1/device/p9  ""
-sudo xenstore-chmod /local/domain/$1/device/p9 n0 r$1
-sudo xenstore-write /local/domain/$1/device/p9/0  ""
-sudo xenstore-chmod /local/domain/$1/device/p9/0 n$1 r0
-sudo  xenstore-write /local/domain/$1/device/p9/0/backend  "/local/domain/0/backend/p9/$1/0"
+	sudo xenstore-write $back ""
+	sudo xenstore-chmod $back n0 r$dom
+	sudo xenstore-write $back/frontend "$front"
+	sudo xenstore-chmod $back/frontend n0 r$dom
+	sudo xenstore-write $back/frontend-id "$dom"
+	sudo xenstore-chmod $back/frontend-id n0 r$dom
+	sudo xenstore-write $back/online "$dom"
+	sudo xenstore-chmod $back/online n0 r$dom
+	sudo xenstore-write $back/state "1"
+	sudo xenstore-chmod $back/state n0 r$dom
 
-sudo xenstore-chmod /local/domain/$1/device/p9/0/backend n$1 r0
-sudo  xenstore-write /local/domain/$1/device/p9/0/backend-id  "0"
-sudo xenstore-chmod /local/domain/$1/device/p9/0/backend-id n$1 r0
-sudo  xenstore-write /local/domain/$1/device/p9/0/state  "1"
-sudo xenstore-chmod /local/domain/$1/device/p9/0/state n$1 r0
+	sudo xenstore-write $front  ""
+	sudo xenstore-chmod $front n$dom r0
+	sudo  xenstore-write $front/backend  "$back"
+	sudo xenstore-chmod $front/backend n$dom r0
+	sudo  xenstore-write $front/backend-id  "0"
+	sudo xenstore-chmod $front/backend-id n$dom r0
+	if [ -n "$tag" ]; then
+		sudo xenstore-write $front/mount_tag "$tag"
+		sudo xenstore-chmod $front/mount_tag n$dom r0
+		sudo xenstore-write $front/mount_tag_len "${#tag}"
+		sudo xenstore-chmod $front/mount_tag_len n$dom r0
+	fi
+	# last: the frontend probes once the state is there
+	sudo  xenstore-write $front/state  "1"
+	sudo xenstore-chmod $front/state n$dom r0
+	dev=$((dev + 1))
+done
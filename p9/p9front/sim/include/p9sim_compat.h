@@ -0,0 +1,36 @@
+/*
+ * Userspace stand-ins for the kernel definitions p9.h, p9_ring.h and
+ * p9_pack.h use, so the simulator compiles them unchanged
+ */
+#ifndef __P9SIM_COMPAT_H__
+#define __P9SIM_COMPAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define BITS_PER_LONG	(8 * __SIZEOF_LONG__)
+
+#define ilog2(n)	(31 - __builtin_clz(n))
+#define __ffs(x)	((unsigned long) __builtin_ctzl(x))
+
+/* 9p and the ring are little endian, as are the hosts this runs on */
+typedef uint32_t __le32;
+#define le32_to_cpu(x)	((uint32_t) (x))
+
+#define mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+
+/* what the Xen public ring.h uses, depending on its interface version */
+#ifndef xen_mb
+#define xen_mb()	mb()
+#define xen_rmb()	rmb()
+#define xen_wmb()	wmb()
+#endif
+
+#endif /* __P9SIM_COMPAT_H__ */
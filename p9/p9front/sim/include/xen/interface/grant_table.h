@@ -0,0 +1,12 @@
+/*
+ * Only grant_ref_t is needed from the grant table interface: the
+ * simulator's grant references index its own table of data pages
+ */
+#ifndef __P9SIM_GRANT_TABLE_H__
+#define __P9SIM_GRANT_TABLE_H__
+
+#include <stdint.h>
+
+typedef uint32_t grant_ref_t;
+
+#endif
@@ -0,0 +1,6 @@
+/*
+ * The kernel's copy of the Xen shared ring header is the public one, which
+ * include/xen/io/ring.h carries the part of that p9.h needs
+ */
+#include "p9sim_compat.h"
+#include <xen/io/ring.h>
@@ -0,0 +1,792 @@
+/*
+ * p9sim - userspace simulation of the Xen 9p transport shared ring
+ *
+ *  Copyright (C) 2015 Linda Jacobson
+ *
+ *  Runs the front end's ring logic (p9_ring.h) and request packing
+ *  (p9_pack.h) against a mock backend thread, over a ring laid out by the
+ *  same DEFINE_RING_TYPES(p9, ...) as p9.h, so the ring protocol can be
+ *  benchmarked without a Xen host.
+ *
+ *  What stands in for Xen:
+ *    - the shared ring and the data rings are ordinary memory both
+ *      threads see
+ *    - grant references index a table of data pages; gref 0 is invalid
+ *    - an eventfd per direction stands in for the event channel
+ *
+ *  The backend echoes each message back as its reply, so a request of
+ *  size bytes moves size bytes in each direction.  Requests are laid out
+ *  by p9_pack_plan as in p9front_handle_client_request: in the data rings
+ *  when they are enabled (-r) and the request fits, else in a slot of a
+ *  pool page when the message and its reply share a page, else as an
+ *  indirect request over pool pages.  Slots, data ring spans and pool
+ *  pages are taken and given back as the front end does.
+ *
+ *  For every queue depth and message size asked for, p9sim prints the
+ *  throughput and the latency percentiles of the requests, measured from
+ *  putting a request on the ring to taking its response off.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "p9sim_compat.h"
+#include "p9.h"
+#include "p9_ring.h"
+#include "p9_pack.h"
+
+#define GRANT_INVALID_REF	0
+
+#define SIM_TYPE	118	/* Twrite; the reply is type + 1 */
+#define SIM_HDR		7	/* size[4] type[1] tag[2] */
+#define SIM_MAX_SIZE	(1U << 20)
+#define SIM_MAX_RING_ORDER	4	/* P9_MAX_RING_PAGE_ORDER of the front end */
+#define SIM_MAX_DATA_RING_ORDER	4	/* P9_MAX_DATA_RING_PAGE_ORDER */
+/* the most segments a backend can take in an indirect request */
+#define SIM_MAX_INDIRECT_SEGS	\
+	(P9_MAX_INDIRECT_PAGES_PER_REQUEST * P9_SEGS_PER_INDIRECT_FRAME)
+
+static const char * const pack_name[] = {
+	[P9_PACK_SLOT] = "slot",
+	[P9_PACK_DATA_RING] = "ring",
+	[P9_PACK_INDIRECT] = "indirect",
+};
+
+/*
+ * a pool page
+ * @slot_free, @slot_class: as in struct grant, while carved into slots
+ * @prev, @next: links in the slot list of its class, -1 at the ends
+ */
+struct sim_page {
+	unsigned long		slot_free;
+	unsigned int		slot_class;
+	int			prev;
+	int			next;
+};
+
+/*
+ * the front end's state of one request
+ * @req:   the request, req.id chaining the free ids as in the front end
+ * @pack:  how it is laid out
+ * @page, @slot_offset: its slot, for a slot request
+ * @span:  its data ring spans, for a data ring request
+ * @start: when it was put on the ring, in ns
+ */
+struct sim_shadow {
+	p9_request_t		req;
+	struct p9_pack		pack;
+	unsigned int		page;
+	unsigned int		slot_offset;
+	unsigned int		span;
+	uint64_t		start;
+};
+
+/*
+ * a data ring, as struct p9_data_ring without the grants
+ */
+struct sim_data_ring {
+	char			*buf;
+	unsigned int		size;
+	uint32_t		prod;
+	uint32_t		cons;
+};
+
+/*
+ * struct sim - one run: a ring, its two ends and the mock grant table
+ * @pages: the grant table; gref n is pages[n - 1]
+ * @page: the state of each page of @pages
+ * @pool, @nr_pool: stack of free pages
+ * @req_pages: per request id, the pool pages of an indirect request, the
+ *        indirect ones last
+ * @slot_pages: per size class, the first page with free slots, or -1
+ * @data_out, @data_in, @spans, @span_head, @span_tail: the data rings, as
+ *        in struct p9_front_queue, when @data_ring_size is set
+ * @msg: the message every request sends
+ * @to_back, @to_front: eventfds standing in for the event channel
+ */
+struct sim {
+	struct p9_sring		*sring;
+	struct p9_front_ring	front;
+	struct p9_back_ring	back;
+	struct sim_shadow	*shadow;
+	unsigned long		shadow_free;
+
+	char			*pages;
+	struct sim_page		*page;
+	unsigned int		*pool;
+	unsigned int		nr_pool;
+	unsigned int		**req_pages;
+	int			slot_pages[P9_NR_SLOT_CLASSES];
+
+	unsigned int		data_ring_size;
+	struct sim_data_ring	data_out;
+	struct sim_data_ring	data_in;
+	struct p9_data_span	*spans;
+	unsigned int		span_head;
+	unsigned int		span_tail;
+
+	char			*msg;
+
+	int			to_back;
+	int			to_front;
+	int			poll;
+	volatile int		stop;
+
+	unsigned long		events_to_back;
+	unsigned long		events_to_front;
+	unsigned long		bad_replies;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *gnt_page(struct sim *sim, grant_ref_t gref)
+{
+	return sim->pages + (size_t) (gref - 1) * PAGE_SIZE;
+}
+
+static grant_ref_t page_gref(unsigned int page)
+{
+	return page + 1;
+}
+
+static void kick(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+}
+
+static void wait_event(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		perror("eventfd read");
+}
+
+static void put_header(char *p, uint32_t size, uint8_t type, uint16_t tag)
+{
+	memcpy(p, &size, 4);
+	p[4] = type;
+	memcpy(p + 5, &tag, 2);
+}
+
+/*
+ * the segments of an indirect request, from its indirect pages
+ */
+static struct p9_request_segment *indirect_seg(struct sim *sim,
+					       p9_request_t *req,
+					       unsigned int n)
+{
+	struct p9_request_segment *frame;
+
+	frame = (struct p9_request_segment *)
+		gnt_page(sim, req->indirect.indirect_grefs[n /
+					P9_SEGS_PER_INDIRECT_FRAME]);
+	return &frame[n % P9_SEGS_PER_INDIRECT_FRAME];
+}
+
+/*
+ * serve - the mock backend's handling of a request: copy the message
+ *         into the reply room, and make it a reply
+ */
+static void serve(struct sim *sim, p9_request_t *req)
+{
+	struct p9_request_segment *in, *out;
+	unsigned int o = 0, i, in_off = 0, out_off = 0, len;
+	char *msg, *reply;
+	uint8_t type;
+	uint16_t tag;
+
+	if (req->nr_segments != P9_SEGMENTS_INDIRECT) {
+		if (req->gref == P9_DATA_RING_REF) {
+			msg = sim->data_out.buf + req->offset;
+			reply = sim->data_in.buf + req->nrbytes;
+		} else {
+			msg = gnt_page(sim, req->gref) + req->offset;
+			reply = msg + req->out_len;
+		}
+		memcpy(reply, msg, req->out_len);
+		put_header(reply, req->out_len, msg[4] + 1, req->tag);
+		return;
+	}
+
+	/* out segments first, then the reply segments */
+	i = req->indirect.nr_out_segments;
+	out = indirect_seg(sim, req, o);
+	in = indirect_seg(sim, req, i);
+	msg = gnt_page(sim, out->gref) + out->offset;
+	type = msg[4];
+	tag = req->tag;
+	while (o < req->indirect.nr_out_segments &&
+	       i < req->indirect.nr_segments) {
+		len = out->nrbytes - out_off;
+		if (len > in->nrbytes - in_off)
+			len = in->nrbytes - in_off;
+		memcpy(gnt_page(sim, in->gref) + in->offset + in_off,
+		       gnt_page(sim, out->gref) + out->offset + out_off, len);
+		out_off += len;
+		in_off += len;
+		if (out_off == out->nrbytes && ++o < req->indirect.nr_out_segments) {
+			out = indirect_seg(sim, req, o);
+			out_off = 0;
+		}
+		if (in_off == in->nrbytes && ++i < req->indirect.nr_segments) {
+			in = indirect_seg(sim, req, i);
+			in_off = 0;
+		}
+	}
+	in = indirect_seg(sim, req, req->indirect.nr_out_segments);
+	put_header(gnt_page(sim, in->gref) + in->offset, req->out_len,
+		   type + 1, tag);
+}
+
+/*
+ * backend - the mock backend thread, serving the ring as a Xen backend
+ *           would: take requests, push responses, then ask for an event
+ *           before sleeping
+ */
+static void *backend(void *arg)
+{
+	struct sim *sim = arg;
+	struct p9_back_ring *ring = &sim->back;
+	p9_request_t req;
+	p9_response_t *rsp;
+	RING_IDX rc, rp;
+	int more, notify;
+
+	for (;;) {
+		rc = ring->req_cons;
+		rp = ring->sring->req_prod;
+		rmb();
+		while (rc != rp) {
+			req = *RING_GET_REQUEST(ring, rc);
+			ring->req_cons = ++rc;
+			serve(sim, &req);
+			rsp = RING_GET_RESPONSE(ring, ring->rsp_prod_pvt);
+			rsp->id = req.id;
+			rsp->tag = req.tag;
+			rsp->status = P9_RSP_OKAY;
+			ring->rsp_prod_pvt++;
+		}
+		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(ring, notify);
+		if (notify) {
+			sim->events_to_front++;
+			kick(sim->to_front);
+		}
+		RING_FINAL_CHECK_FOR_REQUESTS(ring, more);
+		if (more)
+			continue;
+		if (sim->stop)
+			return NULL;
+		wait_event(sim->to_back);
+	}
+}
+
+/* slot list of a size class, as queue->slot_pages */
+static void slot_list_add(struct sim *sim, unsigned int class, int page)
+{
+	sim->page[page].prev = -1;
+	sim->page[page].next = sim->slot_pages[class];
+	if (sim->slot_pages[class] >= 0)
+		sim->page[sim->slot_pages[class]].prev = page;
+	sim->slot_pages[class] = page;
+}
+
+static void slot_list_del(struct sim *sim, unsigned int class, int page)
+{
+	struct sim_page *p = &sim->page[page];
+
+	if (p->prev >= 0)
+		sim->page[p->prev].next = p->next;
+	else
+		sim->slot_pages[class] = p->next;
+	if (p->next >= 0)
+		sim->page[p->next].prev = p->prev;
+}
+
+/*
+ * get_slot - take a slot for @size bytes, as get_slot in the front end
+ */
+static int get_slot(struct sim *sim, struct sim_shadow *shadow,
+		    unsigned int size)
+{
+	unsigned int class = p9_slot_class(size);
+	int page;
+
+	if (sim->slot_pages[class] < 0) {
+		if (!sim->nr_pool)
+			return -ENOSPC;
+		page = sim->pool[--sim->nr_pool];
+		sim->page[page].slot_class = class;
+		sim->page[page].slot_free = P9_SLOTS_MASK(class);
+		slot_list_add(sim, class, page);
+	}
+	page = sim->slot_pages[class];
+	shadow->page = page;
+	shadow->slot_offset = p9_slot_take(&sim->page[page].slot_free, class);
+	if (!sim->page[page].slot_free)
+		slot_list_del(sim, class, page);
+	return 0;
+}
+
+static void put_slot(struct sim *sim, struct sim_shadow *shadow)
+{
+	struct sim_page *p = &sim->page[shadow->page];
+	unsigned int class = p->slot_class;
+
+	if (!p->slot_free)
+		slot_list_add(sim, class, shadow->page);
+	if (p9_slot_put(&p->slot_free, class, shadow->slot_offset)) {
+		slot_list_del(sim, class, shadow->page);
+		sim->pool[sim->nr_pool++] = shadow->page;
+	}
+}
+
+/*
+ * get_data_ring - take the data ring spans of a request, as get_data_ring
+ *                 in the front end
+ */
+static int get_data_ring(struct sim *sim, struct sim_shadow *shadow,
+			 unsigned int out_len, unsigned int in_len)
+{
+	unsigned int mask = RING_SIZE(&sim->front) - 1;
+	uint32_t out_prod = sim->data_out.prod;
+	struct p9_data_span *span;
+	int out_off, in_off;
+
+	if (sim->span_head - sim->span_tail > mask)
+		return -ENOSPC;
+	out_off = p9_data_span_get(&sim->data_out.prod, sim->data_out.cons,
+				   sim->data_out.size, out_len);
+	if (out_off < 0)
+		return out_off;
+	in_off = p9_data_span_get(&sim->data_in.prod, sim->data_in.cons,
+				  sim->data_in.size, in_len);
+	if (in_off < 0) {
+		sim->data_out.prod = out_prod;
+		return in_off;
+	}
+	span = &sim->spans[sim->span_head & mask];
+	span->out_end = sim->data_out.prod;
+	span->in_end = sim->data_in.prod;
+	span->done = false;
+	shadow->span = sim->span_head++;
+	p9_pack_direct(&shadow->req, P9_DATA_RING_REF, out_off, in_off);
+	return 0;
+}
+
+/*
+ * put_request_data - give back the slot, data ring spans or pool pages
+ *                    of a request
+ */
+static void put_request_data(struct sim *sim, struct sim_shadow *shadow)
+{
+	unsigned int *pages = sim->req_pages[shadow->req.id];
+	unsigned int i;
+
+	switch (shadow->pack.kind) {
+	case P9_PACK_SLOT:
+		put_slot(sim, shadow);
+		break;
+	case P9_PACK_DATA_RING:
+		p9_data_spans_put(sim->spans, RING_SIZE(&sim->front) - 1,
+				  shadow->span, &sim->span_tail, sim->span_head,
+				  &sim->data_out.cons, &sim->data_in.cons);
+		break;
+	case P9_PACK_INDIRECT:
+		for (i = 0; i < shadow->pack.nr_pages; i++)
+			sim->pool[sim->nr_pool++] = pages[i];
+		break;
+	}
+}
+
+/*
+ * submit - build a request of @size bytes and put it on the ring, as
+ *          __p9front_handle_client_request does
+ *
+ * Returns -ENOSPC when the data rings or the pool are used up until
+ * responses give some back.
+ */
+static int submit(struct sim *sim, unsigned int size)
+{
+	grant_ref_t indirect_grefs[P9_MAX_INDIRECT_PAGES_PER_REQUEST];
+	struct sim_shadow *shadow;
+	struct p9_pack pack;
+	p9_request_t *req;
+	unsigned int *pages, n, k, len;
+	const char *data;
+	long id;
+	int err;
+
+	err = p9_pack_plan(&pack, size, size, 0, sim->data_ring_size,
+			   SIM_MAX_INDIRECT_SEGS);
+	if (err)
+		return err;
+	id = P9_FREELIST_GET(sim->shadow, RING_SIZE(&sim->front),
+			     &sim->shadow_free);
+	if (id < 0)
+		return id;
+	shadow = &sim->shadow[id];
+	shadow->pack = pack;
+	req = &shadow->req;
+	req->id = id;
+
+	switch (pack.kind) {
+	case P9_PACK_DATA_RING:
+		err = get_data_ring(sim, shadow, size, size);
+		if (err)
+			break;
+		memcpy(sim->data_out.buf + req->offset, sim->msg, size);
+		break;
+	case P9_PACK_SLOT:
+		err = get_slot(sim, shadow, 2 * size);
+		if (err)
+			break;
+		p9_pack_direct(req, page_gref(shadow->page),
+			       shadow->slot_offset, 2 * size);
+		memcpy(gnt_page(sim, req->gref) + req->offset, sim->msg, size);
+		break;
+	case P9_PACK_INDIRECT:
+		if (sim->nr_pool < pack.nr_pages) {
+			err = -ENOSPC;
+			break;
+		}
+		pages = sim->req_pages[id];
+		for (k = 0; k < pack.nr_pages; k++)
+			pages[k] = sim->pool[--sim->nr_pool];
+		/* the indirect pages are the last ones taken from the pool */
+		n = pack.nr_msg_segs + pack.nr_reply_segs;
+		for (k = n; k < pack.nr_pages; k++)
+			indirect_grefs[k - n] = page_gref(pages[k]);
+		p9_pack_indirect(req, indirect_grefs, pack.nr_pages - n);
+		/* message pages, then as many reply pages */
+		for (data = sim->msg, len = size, n = 0; len; n++) {
+			k = p9_pack_page(indirect_seg(sim, req, n),
+					 page_gref(pages[n]),
+					 gnt_page(sim, page_gref(pages[n])),
+					 data, len);
+			data += k;
+			len -= k;
+		}
+		for (len = size; len; n++)
+			len -= p9_pack_page(indirect_seg(sim, req, n),
+					    page_gref(pages[n]),
+					    gnt_page(sim, page_gref(pages[n])),
+					    NULL, len);
+		p9_pack_segments(req, n, pack.nr_msg_segs);
+		break;
+	}
+	if (err) {
+		P9_FREELIST_PUT(sim->shadow, &sim->shadow_free, id);
+		return err;
+	}
+	req->out_len = size;
+	req->in_len = size;
+	req->tag = (uint16_t) id;
+	shadow->start = now_ns();
+	p9_ring_put_request(&sim->front, req);
+	return 0;
+}
+
+/*
+ * reply_ok - whether the reply of a request is the echo of its message,
+ *            found where copy_reply looks for it
+ */
+static int reply_ok(struct sim *sim, struct sim_shadow *shadow)
+{
+	p9_request_t *req = &shadow->req;
+	char *reply;
+
+	switch (shadow->pack.kind) {
+	case P9_PACK_DATA_RING:
+		reply = sim->data_in.buf + req->nrbytes;
+		break;
+	case P9_PACK_SLOT:
+		reply = gnt_page(sim, req->gref) + req->offset + req->out_len;
+		break;
+	default:
+		reply = gnt_page(sim, page_gref(sim->req_pages[req->id][
+					shadow->pack.nr_msg_segs]));
+		break;
+	}
+	return p9_reply_len(reply, req->in_len) == req->out_len &&
+	       (uint8_t) reply[4] == SIM_TYPE + 1 &&
+	       !memcmp(reply + SIM_HDR, sim->msg + SIM_HDR,
+		       (req->out_len < PAGE_SIZE ? req->out_len : PAGE_SIZE) -
+		       SIM_HDR);
+}
+
+/*
+ * complete - take the responses off the ring, as p9_complete does
+ *
+ * Returns nonzero if there are more to take.
+ */
+static int complete(struct sim *sim, uint64_t *lat, unsigned long *done)
+{
+	struct p9_front_ring *ring = &sim->front;
+	struct sim_shadow *shadow;
+	p9_response_t *rsp;
+	RING_IDX i, rp;
+	uint64_t now;
+
+	rp = p9_ring_rsp_prod(ring);
+	now = now_ns();
+	for (i = ring->rsp_cons; i != rp; i++) {
+		rsp = RING_GET_RESPONSE(ring, i);
+		shadow = &sim->shadow[rsp->id];
+		if (rsp->status != P9_RSP_OKAY || !reply_ok(sim, shadow))
+			sim->bad_replies++;
+		lat[(*done)++] = now - shadow->start;
+		put_request_data(sim, shadow);
+		P9_FREELIST_PUT(sim->shadow, &sim->shadow_free, rsp->id);
+	}
+	return p9_ring_finish_responses(ring, i, rp);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(uint64_t *lat, unsigned long n, double pct)
+{
+	unsigned long k = (unsigned long) (pct / 100.0 * (n - 1) + 0.5);
+
+	return lat[k] / 1000.0;
+}
+
+static int alloc_data_ring(struct sim_data_ring *dr, unsigned int size)
+{
+	dr->size = size;
+	dr->prod = dr->cons = 0;
+	dr->buf = size ? aligned_alloc(PAGE_SIZE, size) : NULL;
+	return size && !dr->buf ? -ENOMEM : 0;
+}
+
+/*
+ * run - @count requests of @size bytes, keeping @depth of them in flight,
+ *       with data rings of @data_ring_order pages, or none if negative
+ */
+static int run(unsigned int order, int data_ring_order, unsigned int depth,
+	       unsigned int size, unsigned long count, int poll)
+{
+	struct sim sim;
+	struct p9_pack pack;
+	pthread_t thread;
+	unsigned long submitted = 0, done = 0;
+	unsigned int ring_bytes = PAGE_SIZE << order, nr_pages, k;
+	uint64_t *lat, start, elapsed;
+	int more, stalled;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.poll = poll;
+	if (data_ring_order >= 0)
+		sim.data_ring_size = PAGE_SIZE << data_ring_order;
+	sim.sring = aligned_alloc(PAGE_SIZE, ring_bytes);
+	if (!sim.sring)
+		return -ENOMEM;
+	SHARED_RING_INIT(sim.sring);
+	FRONT_RING_INIT(&sim.front, sim.sring, ring_bytes);
+	BACK_RING_INIT(&sim.back, sim.sring, ring_bytes);
+	if (depth > RING_SIZE(&sim.front))
+		depth = RING_SIZE(&sim.front);
+
+	sim.shadow = calloc(RING_SIZE(&sim.front), sizeof(*sim.shadow));
+	if (!sim.shadow)
+		return -ENOMEM;
+	P9_FREELIST_INIT(sim.shadow, RING_SIZE(&sim.front), &sim.shadow_free);
+
+	/* enough pool pages for @depth requests of this layout */
+	p9_pack_plan(&pack, size, size, 0, sim.data_ring_size,
+		     SIM_MAX_INDIRECT_SEGS);
+	nr_pages = pack.nr_pages ? pack.nr_pages : 1;
+	sim.req_pages = calloc(RING_SIZE(&sim.front), sizeof(*sim.req_pages));
+	if (!sim.req_pages)
+		return -ENOMEM;
+	for (k = 0; k < RING_SIZE(&sim.front); k++) {
+		sim.req_pages[k] = calloc(nr_pages, sizeof(unsigned int));
+		if (!sim.req_pages[k])
+			return -ENOMEM;
+	}
+	nr_pages *= depth;
+	sim.pages = aligned_alloc(PAGE_SIZE, (size_t) nr_pages * PAGE_SIZE);
+	sim.page = calloc(nr_pages, sizeof(*sim.page));
+	sim.pool = calloc(nr_pages, sizeof(*sim.pool));
+	sim.spans = calloc(RING_SIZE(&sim.front), sizeof(*sim.spans));
+	sim.msg = malloc(size);
+	lat = calloc(count, sizeof(*lat));
+	if (!sim.pages || !sim.page || !sim.pool || !sim.spans || !sim.msg ||
+	    !lat || alloc_data_ring(&sim.data_out, sim.data_ring_size) ||
+	    alloc_data_ring(&sim.data_in, sim.data_ring_size))
+		return -ENOMEM;
+	memset(sim.pages, 0x5a, (size_t) nr_pages * PAGE_SIZE);
+	for (k = 0; k < nr_pages; k++)
+		sim.pool[sim.nr_pool++] = nr_pages - 1 - k;
+	for (k = 0; k < P9_NR_SLOT_CLASSES; k++)
+		sim.slot_pages[k] = -1;
+	for (k = 0; k < size; k++)
+		sim.msg[k] = (char) k;
+	put_header(sim.msg, size, SIM_TYPE, 0);
+
+	sim.to_back = eventfd(0, 0);
+	sim.to_front = eventfd(0, 0);
+	if (sim.to_back < 0 || sim.to_front < 0)
+		return -errno;
+	pthread_create(&thread, NULL, backend, &sim);
+
+	start = now_ns();
+	while (done < count) {
+		stalled = 0;
+		while (submitted < count && submitted - done < depth) {
+			if (submit(&sim, size)) {
+				/* data rings full: wait for responses */
+				stalled = 1;
+				break;
+			}
+			submitted++;
+		}
+		if (p9_ring_push(&sim.front)) {
+			sim.events_to_back++;
+			kick(sim.to_back);
+		}
+		more = complete(&sim, lat, &done);
+		/* wait only when nothing more can be submitted */
+		if (!more && submitted > done && (stalled ||
+		    submitted - done == depth || submitted == count)) {
+			if (sim.poll) {
+				while (!RING_HAS_UNCONSUMED_RESPONSES(&sim.front))
+					__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			} else {
+				wait_event(sim.to_front);
+			}
+		}
+	}
+	elapsed = now_ns() - start;
+
+	sim.stop = 1;
+	kick(sim.to_back);
+	pthread_join(thread, NULL);
+
+	qsort(lat, count, sizeof(*lat), cmp_u64);
+	printf("%6u %8u %-8s %10.0f %10.1f %9.1f %9.1f %9.1f %9.1f %8.3f %8.3f %s\n",
+	       depth, size, pack_name[pack.kind], count * 1e9 / elapsed,
+	       2.0 * count * size * 1e3 / elapsed,
+	       pct_us(lat, count, 50), pct_us(lat, count, 99),
+	       pct_us(lat, count, 99.9), lat[count - 1] / 1000.0,
+	       (double) sim.events_to_back / count,
+	       (double) sim.events_to_front / count,
+	       sim.bad_replies ? "BAD" : "ok");
+
+	close(sim.to_back);
+	close(sim.to_front);
+	free(lat);
+	free(sim.msg);
+	free(sim.data_out.buf);
+	free(sim.data_in.buf);
+	free(sim.spans);
+	free(sim.pool);
+	free(sim.page);
+	free(sim.pages);
+	for (k = 0; k < RING_SIZE(&sim.front); k++)
+		free(sim.req_pages[k]);
+	free(sim.req_pages);
+	free(sim.shadow);
+	free(sim.sring);
+	return sim.bad_replies ? -EIO : 0;
+}
+
+static int parse_list(char *arg, unsigned int *list, int max)
+{
+	char *tok;
+	int n = 0;
+
+	for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ","))
+		list[n++] = strtoul(tok, NULL, 0);
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d depth,...] [-s size,...] [-n requests] [-o ring-page-order] [-r data-ring-page-order] [-p]\n"
+		"  -d  requests kept in flight (default 1,8,32)\n"
+		"  -s  message size in bytes, %u to %u (default 128,1024,8192,65536)\n"
+		"  -n  requests per run (default 100000)\n"
+		"  -o  order of the number of ring pages (default 0)\n"
+		"  -r  use data rings of 2^order pages, up to %u (default none)\n"
+		"  -p  poll the ring for responses instead of waiting for events\n",
+		prog, SIM_HDR, SIM_MAX_SIZE, SIM_MAX_DATA_RING_ORDER);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int depths[16] = { 1, 8, 32 }, sizes[16] = { 128, 1024, 8192, 65536 };
+	int nr_depths = 3, nr_sizes = 4, d, s, opt, poll = 0, err = 0;
+	int data_ring_order = -1;
+	unsigned long count = 100000;
+	unsigned int order = 0;
+
+	while ((opt = getopt(argc, argv, "d:s:n:o:r:p")) != -1) {
+		switch (opt) {
+		case 'd':
+			nr_depths = parse_list(optarg, depths, 16);
+			break;
+		case 's':
+			nr_sizes = parse_list(optarg, sizes, 16);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			order = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			data_ring_order = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			poll = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!count || order > SIM_MAX_RING_ORDER ||
+	    data_ring_order > SIM_MAX_DATA_RING_ORDER)
+		usage(argv[0]);
+	for (s = 0; s < nr_sizes; s++)
+		if (sizes[s] < SIM_HDR || sizes[s] > SIM_MAX_SIZE)
+			usage(argv[0]);
+
+	printf("# %s, %lu requests per run, %u ring page(s), ",
+	       poll ? "polling" : "events", count, 1U << order);
+	if (data_ring_order < 0)
+		printf("no data rings\n");
+	else
+		printf("data rings of %u page(s)\n", 1U << data_ring_order);
+	printf("# depth     size layout        ops/s       MB/s   p50(us)   p99(us)  p999(us)   max(us) ev->back ev->front\n");
+	for (d = 0; d < nr_depths; d++)
+		for (s = 0; s < nr_sizes; s++)
+			if (run(order, data_ring_order, depths[d], sizes[s],
+				count, poll))
+				err = 1;
+	return err;
+}
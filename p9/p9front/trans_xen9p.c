@@ -45,28 +45,78 @@
 #include <linux/file.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <net/9p/9p.h>
 #include <linux/parser.h>
 #include <net/9p/client.h>
 #include <net/9p/transport.h>
 #include <linux/scatterlist.h>
 #include <linux/swap.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/srcu.h>
+#include <linux/kref.h>
 #include "trans_common.h"
 #include "p9.h"
+#include "p9_ring.h"
+#include "p9_pack.h"
 #include "xen_9p_front.h"
 
 /* a single mutex to manage channel initialization and attachment */
 static DEFINE_MUTEX(xen_9p_lock);	// do these names have special meaning?
-// static DECLARE_WAIT_QUEUE_HEAD(vp_wq); //do I need this?
-//static atomic_t vp_pinned = ATOMIC_INIT(0); //don't think I need this.
+/* zero copy requests wait here for pinned pages to drop under the limit */
+static DECLARE_WAIT_QUEUE_HEAD(vp_wq);
+static atomic_t vp_pinned = ATOMIC_INIT(0);
 
-static struct list_head xen9p_chan_list;
+/*
+ * the channels of all p9 devices, xenbus and loopback, by mount tag;
+ * under xen_9p_lock
+ */
+#define P9_XEN_CHAN_HASH_BITS	4
+static DEFINE_HASHTABLE(xen9p_chans, P9_XEN_CHAN_HASH_BITS);
+
+static u32 p9_xen_tag_hash(const char *tag, unsigned int len)
+{
+	return jhash(tag, len, 0);
+}
+
+/* most devices one multipath mount spreads over */
+#define P9_XEN_MAX_PATHS	16
+
+/* least room reserved for a reply that is not Rread, Rreaddir or Rreadlink */
+#define P9_XEN_MIN_REPLY 512
+static bool xen_p9_direct_fcall = true;
+module_param_named(direct_fcall, xen_p9_direct_fcall, bool, S_IRUGO);
+MODULE_PARM_DESC(direct_fcall, "Grant the whole pages of large 9p message buffers to the backend instead of copying them");
+
+/* how long a polling mount spins for a reply, unless poll_usecs= says */
+#define P9_XEN_DEFAULT_POLL_USECS 50
+
+/*
+ * mount options handled by this transport; the rest are left to client.c
+ */
+enum {
+	Opt_poll, Opt_hybrid_poll, Opt_poll_usecs, Opt_multipath,
+	Opt_multipath_least, Opt_err,
+};
+
+static const match_table_t tokens = {
+	{Opt_poll, "poll"},
+	{Opt_hybrid_poll, "hybrid_poll"},
+	{Opt_poll_usecs, "poll_usecs=%u"},
+	{Opt_multipath, "multipath"},
+	{Opt_multipath, "multipath=rr"},
+	{Opt_multipath_least, "multipath=least"},
+	{Opt_err, NULL},
+};
 
 /* How many bytes left in this page. */
-/*static unsigned int rest_of_page(void *data)
+static unsigned int rest_of_page(void *data)
 {
 	return PAGE_SIZE - ((unsigned long) data % PAGE_SIZE);
-	}*/
+}
 
 /**
  * p9_xen_close - reclaim resources of a channel
@@ -82,41 +132,198 @@ static struct list_head xen9p_chan_list;
 void p9_xen_close(struct p9_client *client)
 {
 	struct xen9p_chan *chan = client->trans;
+	unsigned int i;
 
+	if (!chan)
+		return;
 	mutex_lock(&xen_9p_lock);
-	if (chan)
-		chan->inuse = false;
+	/* the other paths of a multipath mount go back too */
+	for (i = 1; i < chan->nr_paths; i++) {
+		chan->paths[i]->inuse = false;
+		p9front_put(chan->paths[i]->drv_info);
+	}
+	kfree(chan->paths);
+	chan->paths = NULL;
+	chan->nr_paths = 0;
+	vfree(chan->tag_path);
+	chan->tag_path = NULL;
+	chan->inuse = false;
 	mutex_unlock(&xen_9p_lock);
+	/* the device may have been removed meanwhile: this frees it then */
+	p9front_put(chan->drv_info);
 }
 
 /**
  * req_done - called by handle response when server has completed request
- * @dataptr:  pointer to a buffer containing in this order:
- *            data sent to the server
- *            data sent fromt the server
+ * @chan:   the channel the request was sent on
+ * @status: status of the response
+ * @tag:    9p tag of the request
+ *
+ * The reply is already in rc->sdata: p9_handle_response copies it out of
+ * the data pages before calling here.
  *
  */
 
-void req_done(void *dataptr, struct xen9p_chan *chan, int16_t status,
-	      uint16_t tag)
+void req_done(struct xen9p_chan *chan, int16_t status, uint16_t tag)
 {
-	struct p9_fcall *rc;
-	unsigned int offset;
 	struct p9_req_t *req;
 
-	printk("request done\n");
-
 	/*
 	 *  calls functions in client.c that match requests to responses
 	 *  and wake up the waiting requester
 	 */
 	req = p9_tag_lookup(chan->client, tag);
-	offset = req->tc->size;
-	rc = req->rc;
-	memcpy (rc->sdata, dataptr+offset, rc->size);
 	p9_client_cb(chan->client, req,  REQ_STATUS_RCVD);
 }
 
+/**
+ * p9_xen_req_error - complete a request the device could not carry out
+ * @chan:    the channel the request was sent on
+ * @tag:     9p tag of the request
+ * @in_data: rc->sdata of the request, where the reply goes
+ * @err:     errno to report
+ *
+ * Writes an Rlerror, or an Rerror for the legacy protocols, as if the
+ * server had sent it, and hands it to the client.
+ *
+ */
+
+void p9_xen_req_error(struct xen9p_chan *chan, u16 tag, char *in_data,
+		      int err)
+{
+	static const char ename[] = "I/O error";
+	struct p9_client *client = chan->client;
+	int len;
+
+	if (!chan->inuse || !client)
+		return;
+	/* size[4] type[1] tag[2] */
+	*(__le16 *) (in_data + 5) = cpu_to_le16(tag);
+	if (p9_is_proto_dotl(client)) {
+		/* ecode[4] */
+		in_data[4] = P9_RLERROR;
+		*(__le32 *) (in_data + 7) = cpu_to_le32(err);
+		len = 11;
+	} else {
+		/* ename[s] errno[4] */
+		in_data[4] = P9_RERROR;
+		*(__le16 *) (in_data + 7) = cpu_to_le16(sizeof(ename) - 1);
+		memcpy(in_data + 9, ename, sizeof(ename) - 1);
+		len = 9 + sizeof(ename) - 1;
+		if (p9_is_proto_dotu(client)) {
+			*(__le32 *) (in_data + len) = cpu_to_le32(err);
+			len += 4;
+		}
+	}
+	*(__le32 *) in_data = cpu_to_le32(len);
+	req_done(chan, 0, tag);
+}
+
+/**
+ * p9_xen_zc_release - give back the pages of a zero copy payload
+ * @pages: page array allocated by p9_xen_zc_request
+ * @nr_pages: entries in @pages
+ * @pinned: the pages were pinned by p9_payload_gup
+ *
+ * Called from p9_handle_response once the backend can no longer access
+ * the pages, which may be after p9_xen_zc_request has returned.
+ */
+
+void p9_xen_zc_release(struct page **pages, int nr_pages, int pinned)
+{
+	if (pinned) {
+		p9_release_pages(pages, nr_pages);
+		atomic_sub(nr_pages, &vp_pinned);
+		/* wakeup anybody waiting for slots to pin pages */
+		wake_up(&vp_wq);
+	}
+	kfree(pages);
+}
+
+/**
+ * p9_get_mapped_pages - pin or look up the pages of a zero copy buffer
+ * @chan: channel, for the pinned page limit
+ * @pages: array to fill in
+ * @data: the buffer
+ * @nr_pages: number of pages the buffer spans
+ * @write: the pages will be written to (read from the server)
+ * @kern_buf: @data is a kernel buffer, nothing to pin
+ *
+ */
+
+static int p9_get_mapped_pages(struct xen9p_chan *chan,
+			       struct page **pages, char *data,
+			       int nr_pages, int write, int kern_buf)
+{
+	int err;
+
+	if (!kern_buf) {
+		/*
+		 * We allow only p9_max_pages pinned. We wait for the
+		 * Other zc request to finish here
+		 */
+		if (atomic_read(&vp_pinned) >= chan->p9_max_pages) {
+			err = wait_event_interruptible(vp_wq,
+			      (atomic_read(&vp_pinned) < chan->p9_max_pages));
+			if (err == -ERESTARTSYS)
+				return err;
+		}
+		err = p9_payload_gup(data, &nr_pages, pages, write);
+		if (err < 0)
+			return err;
+		atomic_add(nr_pages, &vp_pinned);
+	} else {
+		/* kernel buffer, no need to pin pages */
+		int s, index = 0;
+		int count = nr_pages;
+
+		while (nr_pages) {
+			s = rest_of_page(data);
+			if (is_vmalloc_addr(data))
+				pages[index++] = vmalloc_to_page(data);
+			else
+				pages[index++] = kmap_to_page(data);
+			data += s;
+			nr_pages--;
+		}
+		nr_pages = count;
+	}
+	return nr_pages;
+}
+
+/**
+ * p9_xen_reply_len - room to reserve for the reply to a request
+ * @req: the request
+ *
+ * rc->capacity is msize, far more than most replies need, and each page
+ * reserved is a data page taken from the ring's pool.  Only Rread and
+ * Rreaddir carry bulk data, bounded by the count in the request, and
+ * Rreadlink a path; any other reply fits in what is left of the page
+ * the message is in.
+ *
+ */
+
+static int p9_xen_reply_len(struct p9_req_t *req)
+{
+	int len;
+
+	switch (req->tc->id) {
+	case P9_TREAD:
+	case P9_TREADDIR:
+		/* size[4] Tread tag[2] fid[4] offset[8] count[4] */
+		len = P9_IOHDRSZ +
+		      le32_to_cpu(*(__le32 *) (req->tc->sdata + 19));
+		break;
+	case P9_TREADLINK:
+		len = P9_IOHDRSZ + PATH_MAX;
+		break;
+	default:
+		len = max_t(int, PAGE_SIZE - req->tc->size, P9_XEN_MIN_REPLY);
+		break;
+	}
+	return min_t(int, len, req->rc->capacity);
+}
+
 /**pack_sg_list_p
  * pack_sg_list - pack a scatter gather list from a linear buffer
  * @sg: scatter/gather list to pack into
@@ -132,77 +339,258 @@ void req_done(void *dataptr, struct xen9p_chan *chan, int16_t status,
  */
 
 
+/**
+ * p9_xen_poll - spin for the reply to a request instead of waiting for
+ *               p9_interrupt
+ * @chan: channel, with the poll mode of the mount
+ * @queue: queue the request was submitted on
+ * @req: the request
+ *
+ * Busy polling checks the ring for up to poll_usecs.  Hybrid polling first
+ * sleeps for half the mean service time seen so far, then polls the same
+ * way.  Either way, a reply that has not arrived by then is left to the
+ * interrupt path.
+ *
+ */
+
+static void p9_xen_poll(struct xen9p_chan *chan, struct p9_front_queue *queue,
+			struct p9_req_t *req)
+{
+	ktime_t start, poll_start;
+	unsigned long sleep_us;
+	s64 elapsed;
+
+	if (chan->poll_mode == P9_XEN_POLL_NONE)
+		return;
+	start = ktime_get();
+	if (chan->poll_mode == P9_XEN_POLL_HYBRID) {
+		sleep_us = chan->poll_mean_ns / 2000;
+		if (sleep_us)
+			usleep_range(sleep_us, sleep_us + 1);
+	}
+	poll_start = ktime_get();
+	do {
+		p9front_poll(queue);
+		if (req->status >= REQ_STATUS_RCVD) {
+			elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+			/* moving average, weight 1/8 */
+			chan->poll_mean_ns = (7 * chan->poll_mean_ns + elapsed) >> 3;
+			return;
+		}
+		cpu_relax();
+	} while (ktime_us_delta(ktime_get(), poll_start) < chan->poll_usecs);
+}
+
+/**
+ * p9_xen_pick_path - the channel of a multipath mount to send a request on
+ * @chan: the channel the mount was made on
+ * @req: the request
+ *
+ * Round-robin takes the paths in turn; least-outstanding takes the one
+ * whose device has the fewest request ids in use, a racy count that is
+ * good enough to steer by.  A Tflush goes where the request it flushes
+ * (oldtag) went, since only that device knows the tag.  The choice is
+ * remembered by tag for p9_xen_cancel.  Without multipath it is @chan
+ * itself.
+ *
+ */
+
+static struct xen9p_chan *p9_xen_pick_path(struct xen9p_chan *chan,
+					   struct p9_req_t *req)
+{
+	unsigned int i, n, best, pick;
+
+	if (!chan->nr_paths)
+		return chan;
+	if (req->tc->id == P9_TFLUSH) {
+		/* size[4] Tflush tag[2] oldtag[2] */
+		pick = chan->tag_path[le16_to_cpu(
+				*(__le16 *) (req->tc->sdata + 7))];
+	} else if (chan->mp_policy == P9_XEN_MP_LEAST) {
+		pick = 0;
+		best = atomic_read(&chan->paths[0]->drv_info->inflight);
+		for (i = 1; i < chan->nr_paths && best; i++) {
+			n = atomic_read(&chan->paths[i]->drv_info->inflight);
+			if (n < best) {
+				best = n;
+				pick = i;
+			}
+		}
+	} else {
+		pick = (unsigned int) atomic_inc_return(&chan->next_path) %
+		       chan->nr_paths;
+	}
+	chan->tag_path[req->tc->tag] = pick;
+	return chan->paths[pick];
+}
+
+/**
+ * p9_xen_submit - put a request on a ring, waiting for room if need be
+ * @chan: channel the mount was made on, with its poll mode
+ * @path: the channel whose device takes the request, from p9_xen_pick_path
+ * @req: request to be issued
+ * @out_len: bytes of tc->sdata to copy into the data pages
+ * @in_len: room to reserve for the reply
+ * @zc_out, @zc_in, @zc_pinned: zero copy payload, see
+ *          p9front_handle_client_request
+ *
+ * When the ring, its request ids or its data pages are used up the queue
+ * clears ring_bufs_avail and we sleep on the channel wait queue until
+ * p9_interrupt frees some and sets it again.  Once the request is on the
+ * ring, a polling mount spins for the reply in p9_xen_poll.
+ *
+ * The queue is only used, for submitting and for polling, inside the
+ * device's SRCU read side, so p9_free never frees it under us; the waits
+ * for the device and for room are outside it.  Once the device is
+ * removed the request fails with EIO.
+ *
+ */
+
+static int p9_xen_submit(struct xen9p_chan *chan, struct xen9p_chan *path,
+			 struct p9_req_t *req, int out_len, int in_len,
+			 struct p9_zc_payload *zc_out,
+			 struct p9_zc_payload *zc_in, int zc_pinned)
+{
+	struct p9_front_info *info = path->drv_info;
+	struct p9_front_queue *queue;
+	ktime_t queued = ktime_get();
+	unsigned int id;
+	int err, idx;
+
+ req_retry:
+	/* a reconnecting device replays what it had in flight first */
+	err = wait_event_interruptible(*path->vc_wq,
+				       info->is_ready || info->removed);
+	if (err == -ERESTARTSYS)
+		return err;
+	if (info->removed)
+		return -EIO;
+	idx = srcu_read_lock(&info->srcu);
+	if (!info->is_ready) {
+		/* p9_free got in first: the queues may be gone */
+		srcu_read_unlock(&info->srcu, idx);
+		goto req_retry;
+	}
+	/* each vCPU submits on its own ring when there are several */
+	queue = p9front_select_queue(info);
+	id = queue->id;
+	err = p9front_handle_client_request (queue,
+					req->tc->tag,
+					req->tc->sdata, out_len,
+					req->rc->sdata, in_len,
+					zc_out, zc_in, zc_pinned, queued);
+	/* polling takes responses off the same queue: still under SRCU */
+	if (!err)
+		p9_xen_poll(chan, queue, req);
+	srcu_read_unlock(&info->srcu, idx);
+	if (err == -EAGAIN)
+		goto req_retry;
+	if (err == -ENOSPC) {
+		/* the queue may be freed meanwhile; go by its index */
+		err = wait_event_interruptible(*path->vc_wq,
+					       p9front_ring_avail(info, id));
+		if (err == -ERESTARTSYS)
+			return err;
+
+		p9_debug(P9_DEBUG_TRANS, "Retry xen request\n");
+		goto req_retry;
+	}
+	if (err < 0) {
+		p9_debug(P9_DEBUG_TRANS, "xen request failed: %d\n", err);
+		return err;
+	}
+	return 0;
+}
+
+/**
+ * p9_xen_fcall_pages - describe the part of an fcall buffer past its first
+ *                      page as a zero copy payload
+ * @fc: the fcall, req->tc or req->rc
+ * @len: bytes of fc->sdata in use: the message, or the room for the reply
+ * @zc: filled in with the pages from the first page boundary in sdata on
+ *
+ * Those pages are granted to the backend as they are, so the message is
+ * read and the reply written in place instead of through the data pages.
+ * They must hold nothing but this fcall: it has to start a page and own
+ * whole pages, as the kmalloc allocations client.c makes for messages
+ * near a page or larger do.  The first page, holding struct p9_fcall
+ * itself, is never granted; its share of the buffer is still copied.
+ *
+ * Returns the number of bytes to copy, @len if nothing is granted.
+ *
+ */
+
+static int p9_xen_fcall_pages(struct p9_fcall *fc, int len,
+			      struct p9_zc_payload *zc)
+{
+	char *data;
+	int head, nr_pages, i;
+
+	head = rest_of_page(fc->sdata);
+	if (!xen_p9_direct_fcall || len <= head || is_vmalloc_addr(fc) ||
+	    ((unsigned long) fc & ~PAGE_MASK) || (ksize(fc) & ~PAGE_MASK))
+		return len;
+	data = fc->sdata + head;
+	nr_pages = p9_nr_pages(data, len - head);
+	zc->pages = kmalloc(sizeof(struct page *) * nr_pages, GFP_NOFS);
+	if (!zc->pages)
+		return len;
+	for (i = 0; i < nr_pages; i++)
+		zc->pages[i] = virt_to_page(data + i * PAGE_SIZE);
+	zc->nr_pages = nr_pages;
+	zc->offset = 0;
+	zc->len = len - head;
+	return head;
+}
+
 /**
  * p9_xen_request - issue a request: use xen code to send request
  *               no sg list for now
  * @client: client instance issuing the request
  * @req: request to be issued
  *
+ * The message and reply go through the data rings or data pages, except
+ * for whatever p9_xen_fcall_pages lets the backend access in place when
+ * they are too large for the data rings.
+ *
  */
 
 static int p9_xen_request(struct p9_client *client, struct p9_req_t *req)
 {
 	int err;
-	//	int in, out, out_sgs, in_sgs;
 	int out_len, in_len;
-	// unsigned long flags;
-	struct xen9p_chan *chan = client->trans;
-	//	struct scatterlist *sgs[2];
+	struct xen9p_chan *chan = client->trans, *path;
+	struct p9_zc_payload zc_out = { NULL }, zc_in = { NULL };
 
-	p9_debug(P9_DEBUG_TRANS, "9p debug: virtio request\n");
+	p9_debug(P9_DEBUG_TRANS, "9p debug: xen request\n");
 	req->status = REQ_STATUS_SENT;
-	out_len = req->tc->size;
-	in_len  = req->rc->capacity;
 	/*
          * fyi all the metadata in the fcalls tc & rc is already in the data
          */
-	err = p9front_handle_client_request (chan->drv_info,
-					req->tc->tag,
-					req->tc->sdata, out_len,
-					req->rc->sdata, in_len);
-	/* - no scatter gather or queues for now*/
-	
-   /*      req_retry:
-	spin_lock_irqsave(&chan->lock, flags);
-
-		out_sgs = in_sgs = 0;
-			
-	out = pack_sg_list(chan->sg, 0,
-			   NUM_P9_SGLISTS, req->tc->sdata, req->tc->size);
-	if (out)
-		sgs[out_sgs++] = chan->sg;
-
-	in = pack_sg_list(chan->sg, out,
-			  NUM_P9_SGLISTS, req->rc->sdata,
-			  req->rc->capacity);
-	if (in)
-		sgs[out_sgs + in_sgs++] = chan->sg + out;
-
-	
+	out_len = req->tc->size;
+	in_len = p9_xen_reply_len(req);
+	/*
+	 * what fits in the data rings of the device it goes to is copied
+	 * there, granting nothing
+	 */
+	path = p9_xen_pick_path(chan, req);
+	if (!p9front_data_ring_fits(path->drv_info, out_len, in_len, 0)) {
+		out_len = p9_xen_fcall_pages(req->tc, out_len, &zc_out);
+		in_len = p9_xen_fcall_pages(req->rc, in_len, &zc_in);
+	}
+	err = p9_xen_submit(chan, path, req, out_len, in_len,
+			    zc_out.pages ? &zc_out : NULL,
+			    zc_in.pages ? &zc_in : NULL, 0);
 	if (err < 0) {
-		if (err == -ENOSPC) {
-			chan->ring_bufs_avail = 0;
-			spin_unlock_irqrestore(&chan->lock, flags);
-			err = wait_event_interruptible(*chan->vc_wq,
-						       chan->
-						       ring_bufs_avail);
-			if (err == -ERESTARTSYS)
-				return err;
-
-			p9_debug(P9_DEBUG_TRANS, "Retry virtio request\n");
-			goto req_retry;
-		} else {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			p9_debug(P9_DEBUG_TRANS,
-				 "virtio rpc add_sgs returned failure\n");
-			return -EIO;
-		}
+		/* not submitted: the page arrays are still ours */
+		if (zc_out.pages)
+			p9_xen_zc_release(zc_out.pages, zc_out.nr_pages, 0);
+		if (zc_in.pages)
+			p9_xen_zc_release(zc_in.pages, zc_in.nr_pages, 0);
+		return err;
 	}
-	virtqueue_kick(chan->vq);
-	spin_unlock_irqrestore(&chan->lock, flags);
 
-	p9_debug(P9_DEBUG_TRANS, "virtio request kicked\n");*/
-	
+	p9_debug(P9_DEBUG_TRANS, "xen request kicked\n");
 	return 0;
 }
 
@@ -217,25 +605,30 @@ static int p9_xen_request(struct p9_client *client, struct p9_req_t *req)
  * @olen: write buffer size
  * @hdrlen: reader header size, This is the size of response protocol data
  *
+ * Only the 9p message and the reply header go through the data page; the
+ * payload pages are granted to the backend, which reads and writes them
+ * in place.  The pages stay granted (and pinned) until the response
+ * arrives, even if we are interrupted while waiting for it.
+ *
  */
 static int
 p9_xen_zc_request(struct p9_client *client, struct p9_req_t *req,
 		  char *uidata, char *uodata, int inlen,
 		  int outlen, int in_hdr_len, int kern_buf)
 {
-  /*  	int in, out, err, out_sgs, in_sgs;
-	unsigned long flags;
+	int err;
 	int in_nr_pages = 0, out_nr_pages = 0;
 	struct page **in_pages = NULL, **out_pages = NULL;
+	struct p9_zc_payload zc_out, zc_in;
 	struct xen9p_chan *chan = client->trans;
-	struct scatterlist *sgs[4];*/
 
 	p9_debug(P9_DEBUG_TRANS, "xen 9p zcrequest\n");
-	p9_xen_request (client, req);
-	return 0;  // this is on purpose - not implementing at the moment
-	/*
-	if (uodata) {
+	if (uodata)
 		out_nr_pages = p9_nr_pages(uodata, outlen);
+	if (uidata)
+		in_nr_pages = p9_nr_pages(uidata, inlen);
+
+	if (uodata) {
 		out_pages = kmalloc(sizeof(struct page *) * out_nr_pages,
 				    GFP_NOFS);
 		if (!out_pages) {
@@ -251,9 +644,12 @@ p9_xen_zc_request(struct p9_client *client, struct p9_req_t *req,
 			out_pages = NULL;
 			goto err_out;
 		}
+		zc_out.pages = out_pages;
+		zc_out.nr_pages = out_nr_pages;
+		zc_out.offset = offset_in_page(uodata);
+		zc_out.len = outlen;
 	}
 	if (uidata) {
-		in_nr_pages = p9_nr_pages(uidata, inlen);
 		in_pages = kmalloc(sizeof(struct page *) * in_nr_pages,
 				   GFP_NOFS);
 		if (!in_pages) {
@@ -269,91 +665,224 @@ p9_xen_zc_request(struct p9_client *client, struct p9_req_t *req,
 			in_pages = NULL;
 			goto err_out;
 		}
+		zc_in.pages = in_pages;
+		zc_in.nr_pages = in_nr_pages;
+		zc_in.offset = offset_in_page(uidata);
+		zc_in.len = inlen;
 	}
 	req->status = REQ_STATUS_SENT;
- req_retry_pinned:
-	spin_lock_irqsave(&chan->lock, flags);
-
-	out_sgs = in_sgs = 0;
-
-	out = pack_sg_list(chan->sg, 0,
-			   NUM_P9_SGLISTS, req->tc->sdata, req->tc->size);
-
-	if (out)
-		sgs[out_sgs++] = chan->sg;
 
-	if (out_pages) {
-		sgs[out_sgs++] = chan->sg + out;
-		out += pack_sg_list_p(chan->sg, out, NUM_P9_SGLISTS,
-				      out_pages, out_nr_pages, uodata,
-				      outlen);
-	}
-	*/
 	/*
 	 * Take care of in data
 	 * For example TREAD have 11.
 	 * 11 is the read/write header = PDU Header(7) + IO Size (4).
 	 * Arrange in such a way that server places header in the
-	 * alloced memory and payload onto the user buffer.
+	 * data page and payload onto the user buffer.
 	 */
-	/*	in = pack_sg_list(chan->sg, out,
-			  NUM_P9_SGLISTS, req->rc->sdata, in_hdr_len);
-	if (in)
-		sgs[out_sgs + in_sgs++] = chan->sg + out;
-
-	if (in_pages) {
-		sgs[out_sgs + in_sgs++] = chan->sg + out + in;
-		in += pack_sg_list_p(chan->sg, out + in, NUM_P9_SGLISTS,
-				     in_pages, in_nr_pages, uidata, inlen);
-	}
+	err = p9_xen_submit(chan, p9_xen_pick_path(chan, req), req,
+			    req->tc->size, in_hdr_len,
+			    out_pages ? &zc_out : NULL,
+			    in_pages ? &zc_in : NULL,
+			    !kern_buf);
+	if (err < 0)
+		goto err_out;
 
-	BUG_ON(out_sgs + in_sgs > ARRAY_SIZE(sgs));
-	err = virtqueue_add_sgs(chan->vq, sgs, out_sgs, in_sgs, req->tc,
-				GFP_ATOMIC);
-	if (err < 0) {
-		if (err == -ENOSPC) {
-			chan->ring_bufs_avail = 0;
-			spin_unlock_irqrestore(&chan->lock, flags);
-			err = wait_event_interruptible(*chan->vc_wq,
-						       chan->
-						       ring_bufs_avail);
-			if (err == -ERESTARTSYS)
-				goto err_out;
-
-			p9_debug(P9_DEBUG_TRANS, "Retry virtio request\n");
-			goto req_retry_pinned;
-		} else {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			p9_debug(P9_DEBUG_TRANS,
-				 "virtio rpc add_sgs returned failure\n");
-			err = -EIO;
-			goto err_out;
-		}
-	}
-	virtqueue_kick(chan->vq);
-	spin_unlock_irqrestore(&chan->lock, flags);
-	p9_debug(P9_DEBUG_TRANS, "virtio request kicked\n");
+	/*
+	 * from here on the pages belong to the queue; they are released by
+	 * p9_xen_zc_release when the backend answers
+	 */
+	p9_debug(P9_DEBUG_TRANS, "xen 9p request kicked\n");
 	err = wait_event_interruptible(*req->wq,
 				       req->status >= REQ_STATUS_RCVD);
-	
-	 * Non kernel buffers are pinned, unpin them
-	 
-	      err_out:
-	if (!kern_buf) {
-		if (in_pages) {
-			p9_release_pages(in_pages, in_nr_pages);
-			atomic_sub(in_nr_pages, &vp_pinned);
-		}
-		if (out_pages) {
-			p9_release_pages(out_pages, out_nr_pages);
-			atomic_sub(out_nr_pages, &vp_pinned);
+	return err;
+
+ err_out:
+	if (in_pages)
+		p9_xen_zc_release(in_pages, in_nr_pages, !kern_buf);
+	if (out_pages)
+		p9_xen_zc_release(out_pages, out_nr_pages, !kern_buf);
+	return err;
+}
+
+/**
+ * parse_opts - parse the mount options of this transport
+ * @params: options string passed from mount
+ * @chan: channel to set the poll mode of
+ *
+ * poll and hybrid_poll select the completion mode, see p9_xen_poll;
+ * poll_usecs=N bounds the time spent polling.  multipath (or multipath=rr)
+ * and multipath=least spread the mount over every device with its tag
+ * and 9P session, see p9_xen_bind_paths and p9_xen_pick_path.  Other options are ignored.
+ *
+ */
+
+static int parse_opts(char *params, struct xen9p_chan *chan)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+	int option;
+	char *options, *tmp_options;
+
+	chan->poll_mode = P9_XEN_POLL_NONE;
+	chan->poll_usecs = P9_XEN_DEFAULT_POLL_USECS;
+	chan->poll_mean_ns = 0;
+	chan->mp_policy = P9_XEN_MP_NONE;
+
+	if (!params)
+		return 0;
+
+	tmp_options = kstrdup(params, GFP_KERNEL);
+	if (!tmp_options) {
+		p9_debug(P9_DEBUG_ERROR,
+			 "failed to allocate copy of option string\n");
+		return -ENOMEM;
+	}
+	options = tmp_options;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		int token;
+		int r;
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_poll:
+			chan->poll_mode = P9_XEN_POLL_BUSY;
+			break;
+		case Opt_hybrid_poll:
+			chan->poll_mode = P9_XEN_POLL_HYBRID;
+			break;
+		case Opt_poll_usecs:
+			r = match_int(&args[0], &option);
+			if (r < 0 || option < 0) {
+				p9_debug(P9_DEBUG_ERROR,
+					 "integer field, but no integer?\n");
+				continue;
+			}
+			chan->poll_usecs = option;
+			break;
+		case Opt_multipath:
+			chan->mp_policy = P9_XEN_MP_RR;
+			break;
+		case Opt_multipath_least:
+			chan->mp_policy = P9_XEN_MP_LEAST;
+			break;
+		default:
+			continue;
 		}
-		 wakeup anybody waiting for slots to pin pages 
-			wake_up(&vp_wq);
 	}
-	kfree(in_pages);
-	kfree(out_pages);
-	return err;*/
+
+	kfree(tmp_options);
+	return 0;
+}
+
+/*
+ * p9_xen_set_session - record the multipath-session a device's backend
+ * published, taking over @session (NULL if none)
+ */
+void p9_xen_set_session(struct xen9p_chan *chan, char *session)
+{
+	char *old;
+
+	mutex_lock(&xen_9p_lock);
+	old = chan->session;
+	chan->session = session;
+	mutex_unlock(&xen_9p_lock);
+	kfree(old);
+}
+
+/* @path can stand in for @chan: same tag, same 9P session; xen_9p_lock */
+static bool p9_xen_same_session(struct xen9p_chan *chan,
+				struct xen9p_chan *path)
+{
+	return path->session && path->tag_len == chan->tag_len &&
+	       !memcmp(path->tag, chan->tag, chan->tag_len) &&
+	       !strcmp(path->session, chan->session);
+}
+
+/**
+ * p9_xen_bind_paths - claim every other free channel with the tag and the
+ *                     9P session of @chan for a multipath mount
+ * @chan: the channel the mount was made on, already in use
+ * @client: the mount's client
+ *
+ * Each backend normally runs a 9P session of its own, with its own fid
+ * table, so a fid attached through one device means nothing to another.
+ * Only devices whose backends publish the same multipath-session node
+ * serve one session and can take each other's requests; a mount on a
+ * device that publishes none is refused multipath.
+ *
+ */
+
+static int p9_xen_bind_paths(struct xen9p_chan *chan,
+			     struct p9_client *client)
+{
+	struct xen9p_chan *path;
+	unsigned int n = 1;
+
+	/* a byte per tag, P9_NOTAG included */
+	chan->tag_path = vzalloc(P9_NOTAG + 1);
+	if (!chan->tag_path)
+		return -ENOMEM;
+	mutex_lock(&xen_9p_lock);
+	if (!chan->session) {
+		mutex_unlock(&xen_9p_lock);
+		pr_err("%s: backend shares no session, no multipath\n",
+		       chan->tag);
+		vfree(chan->tag_path);
+		chan->tag_path = NULL;
+		return -EINVAL;
+	}
+	hash_for_each_possible(xen9p_chans, path, chan_node,
+			       p9_xen_tag_hash(chan->tag, chan->tag_len))
+		if (!path->inuse && p9_xen_same_session(chan, path))
+			n++;
+	n = min_t(unsigned int, n, P9_XEN_MAX_PATHS);
+	chan->paths = kcalloc(n, sizeof(*chan->paths), GFP_KERNEL);
+	if (!chan->paths) {
+		mutex_unlock(&xen_9p_lock);
+		vfree(chan->tag_path);
+		chan->tag_path = NULL;
+		return -ENOMEM;
+	}
+	chan->paths[chan->nr_paths++] = chan;
+	hash_for_each_possible(xen9p_chans, path, chan_node,
+			       p9_xen_tag_hash(chan->tag, chan->tag_len)) {
+		if (chan->nr_paths == n)
+			break;
+		if (path->inuse || !p9_xen_same_session(chan, path))
+			continue;
+		path->inuse = true;
+		path->client = client;
+		p9front_get(path->drv_info);
+		chan->paths[chan->nr_paths++] = path;
+	}
+	atomic_set(&chan->next_path, 0);
+	mutex_unlock(&xen_9p_lock);
+	pr_info("%s: multipath over %u devices\n", chan->tag, chan->nr_paths);
+	return 0;
+}
+
+/**
+ * p9_xen_max_msize - largest msize every device of a mount can carry, 0 if
+ *                    none is connected yet
+ * @chan: the channel the mount was made on
+ *
+ */
+
+static unsigned int p9_xen_max_msize(struct xen9p_chan *chan)
+{
+	unsigned int i, n, max;
+
+	if (!chan->nr_paths)
+		return p9front_max_msize(chan->drv_info);
+	max = 0;
+	for (i = 0; i < chan->nr_paths; i++) {
+		n = p9front_max_msize(chan->paths[i]->drv_info);
+		if (n && (!max || n < max))
+			max = n;
+	}
+	return max;
 }
 
 /**
@@ -361,13 +890,20 @@ p9_xen_zc_request(struct p9_client *client, struct p9_req_t *req,
  *                 I'm copying
  * @client: client instance invoking this transport
  * @devname: string identifying the channel to connect to 
- * @args: args passed from sys_mount() for per-transport options (unused in this
- *        func - client.c has already parsed them, and stored relevant info in 
- *        p9_client struct
+ * @args: args passed from sys_mount() for per-transport options; client.c
+ *        has already parsed its own and stored them in the p9_client struct,
+ *        parse_opts picks out the poll mode
  *
  * This sets up a transport channel for 9p communication. 
- * Match the first available channel, using a simple reference count mechanism to ensure
- * that only a single mount has a channel open at a time.
+ * Match the first available channel with the tag, using a simple reference
+ * count mechanism to ensure that only a single mount has a channel open at
+ * a time.  Each p9 device of the domain has its own channel and rings, so
+ * mounts of different tags do not share a ring.  With the multipath
+ * option one mount takes all the free channels with its tag.
+ *
+ * The client's msize is lowered to the largest the device negotiated with
+ * its backend (see p9front_set_max_msize), so a mount asking for more
+ * gets what both sides support instead of requests failing with E2BIG.
  *
  */
 
@@ -375,28 +911,45 @@ static int
 p9_xen_create(struct p9_client *client, const char *devname, char *args)
 {
 	struct xen9p_chan *chan;
-	int ret = 0;
+	unsigned int len = strlen(devname), max;
+	int ret = -ENOENT;
 	int found = 0;
 
 	mutex_lock(&xen_9p_lock);
-	list_for_each_entry(chan, &xen9p_chan_list, chan_list) {
-	  if (!strncmp(devname, chan->tag, chan->tag_len) &&
-	      strlen(devname) == chan->tag_len) {
-			if (!chan->inuse) {
-				chan->inuse = true;
-				found = 1;
-				break;
-			}
-			ret = -EBUSY;
-			goto out;
+	hash_for_each_possible(xen9p_chans, chan, chan_node,
+			       p9_xen_tag_hash(devname, len)) {
+		if (chan->tag_len != len || memcmp(devname, chan->tag, len))
+			continue;
+		if (!chan->inuse) {
+			chan->inuse = true;
+			/* the channel outlives its device until we close it */
+			p9front_get(chan->drv_info);
+			found = 1;
+			break;
 		}
+		ret = -EBUSY;
 	}
 	mutex_unlock(&xen_9p_lock);
 
 	if (!found) {
-		pr_err("no channels available\n");
-		ret = ENOENT;	
+		pr_err("no channels available for %s\n", devname);
 	} else {
+		ret = parse_opts(args, chan);
+		if (!ret && chan->mp_policy != P9_XEN_MP_NONE)
+			ret = p9_xen_bind_paths(chan, client);
+		if (ret < 0) {
+			mutex_lock(&xen_9p_lock);
+			chan->inuse = false;
+			mutex_unlock(&xen_9p_lock);
+			p9front_put(chan->drv_info);
+			goto out;
+		}
+		max = p9_xen_max_msize(chan);
+		if (max && client->msize > max) {
+			p9_debug(P9_DEBUG_TRANS, "msize %u lowered to %u\n",
+				 client->msize, max);
+			client->msize = max;
+		}
 		client->trans = (void *) chan;
 		client->status = Connected;
 		chan->client = client;
@@ -406,11 +959,56 @@ p9_xen_create(struct p9_client *client, const char *devname, char *args)
 }
 
 /*
- * not handling cancels at the moment
+ * p9_xen_add_chan - make a channel available to mount by its tag
+ */
+void p9_xen_add_chan(struct xen9p_chan *chan)
+{
+	mutex_lock(&xen_9p_lock);
+	hash_add(xen9p_chans, &chan->chan_node,
+		 p9_xen_tag_hash(chan->tag, chan->tag_len));
+	mutex_unlock(&xen_9p_lock);
+}
+
+void p9_xen_del_chan(struct xen9p_chan *chan)
+{
+	mutex_lock(&xen_9p_lock);
+	hash_del(&chan->chan_node);
+	mutex_unlock(&xen_9p_lock);
+}
+
+/**
+ * p9_xen_cancel - the requester was interrupted waiting for its reply
+ * @client: client instance
+ * @req: the request
+ *
+ * Returns 1 if the request is still with the backend: it is cancelled in
+ * the queue (p9front_cancel) of the path it was sent on and the client
+ * flushes it, through the same path (see p9_xen_pick_path).  Its id and
+ * pages are reclaimed when the backend answers, without touching the
+ * reply buffer, which by then may belong to the next user of the tag.
+ *
+ * Returns 0 if the reply has arrived, waiting for it first if it is
+ * already being handed over, or if the backend may still write it into
+ * pages the client owns (rc->sdata granted in place, a kernel buffer) and
+ * they could not be revoked, so the client sees REQ_STATUS_RCVD.
+ *
  */
-static int p9_xen_cancel (struct p9_client *client, struct p9_req_t *req)
+static int p9_xen_cancel(struct p9_client *client, struct p9_req_t *req)
 {
-	return 1;
+	struct xen9p_chan *chan = client->trans;
+	int ret;
+
+	if (req->status >= REQ_STATUS_RCVD)
+		return 0;
+	/* a multipath request is on the path its tag was sent on */
+	if (chan->nr_paths)
+		chan = chan->paths[chan->tag_path[req->tc->tag]];
+	ret = p9front_cancel(chan->drv_info, req->tc->tag);
+	if (ret == -EINPROGRESS) {
+		wait_event(*req->wq, req->status >= REQ_STATUS_RCVD);
+		ret = 0;
+	}
+	return ret;
 }
 
 static struct p9_trans_module p9_xen_trans = {
@@ -421,12 +1019,13 @@ static struct p9_trans_module p9_xen_trans = {
 	.zc_request = p9_xen_zc_request,
 	.cancel = p9_xen_cancel,
 	/*
-	 * We leave one entry for input and one entry for response
-	 * headers. We also skip one more entry to accomodate, address
-	 * that are not at page boundary, that can result in an extra
-	 * page in zero copy.
+	 * The largest indirect request any backend could take, less one
+	 * segment each for the message, the reply and a zero copy payload
+	 * that is not at a page boundary.  p9_xen_create clamps msize to
+	 * what the device actually negotiated.
 	 */
-	.maxsize = PAGE_SIZE * (NUM_P9_SGLISTS - 3),
+	.maxsize = PAGE_SIZE * (P9_MAX_INDIRECT_PAGES_PER_REQUEST *
+				P9_SEGS_PER_INDIRECT_FRAME - 3),
 	.def = 0,
 	.owner = THIS_MODULE,
 };
@@ -437,8 +1036,6 @@ static struct p9_trans_module p9_xen_trans = {
 void init_xen_9p(void)
 {
   printk(KERN_INFO "entering init_xen_9p\n");
-	INIT_LIST_HEAD(&xen9p_chan_list);
-	printk(KERN_INFO "just init chan_list\n");
 	v9fs_register_trans(&p9_xen_trans);
 	printk(KERN_INFO "just registered transport\n");
 }
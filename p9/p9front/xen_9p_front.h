@@ -37,7 +37,61 @@
 
 #define NUM_P9_SGLISTS	128
 
+/*
+ * largest shared ring we will negotiate: 2^P9_MAX_RING_PAGE_ORDER pages
+ */
+#define P9_MAX_RING_PAGE_ORDER	4
+#define P9_MAX_RING_PAGES	(1U << P9_MAX_RING_PAGE_ORDER)
+#define P9_MAX_RING_SIZE	\
+	__CONST_RING_SIZE(p9, PAGE_SIZE * P9_MAX_RING_PAGES)
+
+/*
+ * largest data rings we will negotiate, each 2^P9_MAX_DATA_RING_PAGE_ORDER
+ * pages; slot sizes and data ring spans are in p9_pack.h
+ */
+#define P9_MAX_DATA_RING_PAGE_ORDER	4
+#define P9_MAX_DATA_RING_PAGES	(1U << P9_MAX_DATA_RING_PAGE_ORDER)
+
 struct p9_front_info;
+struct p9_loop;
+
+/*
+ * latency histograms: per request type, the time spent in each phase of a
+ * request, in log2 microsecond buckets (see p9_record_latency)
+ */
+#define P9_LAT_BUCKETS		20
+#define P9_LAT_NR_TYPES		64
+#define P9_LAT_TYPE(_type)	(((_type) >> 1) & (P9_LAT_NR_TYPES - 1))
+
+enum p9_lat_phase {
+	P9_LAT_QUEUE,		/* handed to the transport until on the ring */
+	P9_LAT_SERVICE,		/* on the ring until its response is consumed */
+	P9_LAT_COMPLETE,	/* consumed until the 9p client is told */
+	P9_LAT_NR,
+};
+
+struct p9_latency {
+	atomic_long_t		hist[P9_LAT_NR_TYPES][P9_LAT_NR][P9_LAT_BUCKETS];
+};
+
+/*
+ * how a request waits for its reply, chosen per mount (see p9_xen_poll)
+ */
+enum p9_xen_poll_mode {
+	P9_XEN_POLL_NONE,	/* sleep until p9_interrupt completes it */
+	P9_XEN_POLL_BUSY,	/* spin on the ring for up to poll_usecs */
+	P9_XEN_POLL_HYBRID,	/* sleep for part of the service time, then spin */
+};
+
+/*
+ * how a multipath mount spreads its requests over its channels, from the
+ * multipath and multipath=least options (see p9_xen_pick_path)
+ */
+enum p9_xen_mp_policy {
+	P9_XEN_MP_NONE,		/* one channel only */
+	P9_XEN_MP_RR,		/* round-robin */
+	P9_XEN_MP_LEAST,	/* the device with the fewest requests in flight */
+};
 
 /*
  * struct xen9p_chan - per-instance transport information
@@ -49,6 +103,21 @@ struct p9_front_info;
  *          This is not optimal, but allows me to make as few changes as 
  *          possible to template code.
  * @sg: scatter gather list which is used to pack a request (protected?)
+ * @poll_mode, @poll_usecs: how requests of the current mount wait for
+ *        their replies, from the poll, hybrid_poll and poll_usecs= options
+ * @poll_mean_ns: moving average of the service time seen while polling,
+ *        how long hybrid polling sleeps before it spins
+ * @mp_policy: how requests are spread over @paths
+ * @paths, @nr_paths: the channel the mount was made on followed by every
+ *        other free channel with the same tag and multipath @session; set
+ *        by p9_xen_create on the first channel only, with each path's
+ *        @client the mount's client so its replies reach req_done by tag
+ *        as usual
+ * @next_path: round-robin cursor
+ * @tag_path: index in @paths of the path each tag was last sent on, so a
+ *        Tflush and p9front_cancel reach the device holding the request
+ * @session: the backend's multipath-session node, NULL if it has none;
+ *        under xen_9p_lock, see p9_xen_set_session
  *
  * We keep all per-channel information in a structure.
  * This structure is allocated within the devices dev->mem space.
@@ -63,13 +132,24 @@ struct xen9p_chan {
 
 	struct p9_client	*client;
 	struct p9_front_info	*drv_info;
-	//  CHANGE? probably work_struct in info is better place
+	/* submitters wait here for room on a full queue */
 	wait_queue_head_t 	*vc_wq;  
 
 	/* This is global limit. Since we don't have a global structure,
 	 * will be placing it in each channel.
 	 */
 	unsigned long		p9_max_pages;
+
+	enum p9_xen_poll_mode	poll_mode;
+	unsigned int		poll_usecs;
+	u64			poll_mean_ns;
+
+	enum p9_xen_mp_policy	mp_policy;
+	struct xen9p_chan	**paths;
+	unsigned int		nr_paths;
+	atomic_t		next_path;
+	u8			*tag_path;
+	char			*session;
 	/*
 	 * CHANGE:   Redefine magic # to Xen appropriate name
 	 * Scatterlist: can be too big for stack. 
@@ -79,20 +159,278 @@ struct xen9p_chan {
 	int			tag_len;
 	char			*tag;   /* tag to identify mount name: diff from client tag*/
 
-	struct list_head	chan_list;
+	struct hlist_node	chan_node;	/* in the registry, by tag */
 };
 
+/*
+ * struct grant - a data page shared with the backend
+ * @gref: grant reference, GRANT_INVALID_REF while the page is not granted
+ * @pfn:  page frame of the data page owned by this entry
+ * @node: link in p9_front_queue.grants while the page is free, in a
+ *        request's list while it holds the page, or in slot_pages while
+ *        the page is carved into slots and some are free
+ * @slot_class: size class of the slots the page is carved into
+ * @slot_free: bitmap of the free slots
+ *
+ */
 struct grant {
 	grant_ref_t gref;
 	unsigned long pfn;
 	struct list_head node;
+	unsigned int slot_class;
+	unsigned long slot_free;
+};
+
+/*
+ * struct p9_zc_payload - zero copy payload of a request
+ * @pages:    the pages holding the payload
+ * @nr_pages: number of entries in @pages
+ * @offset:   offset of the payload in the first page
+ * @len:      length of the payload in bytes
+ *
+ */
+struct p9_zc_payload {
+	struct page		**pages;
+	int			nr_pages;
+	unsigned int		offset;
+	unsigned int		len;
+};
+
+/*
+ * struct p9_shadow - frontend copy of the state of an in-flight request
+ * @req:  copy of the ring request, for the zero copy grants to revoke
+ * @grants: the pool pages of the request, returned to the pool when the
+ *          response arrives: the message pages, the reply pages, then the
+ *          indirect pages.  A direct request has a single page holding
+ *          the message followed by room for the reply.
+ * @indirect: the pages holding the segments of an indirect request
+ * @slot, @slot_offset: the page and offset of the slot holding the
+ *          message and room for the reply of a direct request
+ * @data_ring, @span: the message and room for the reply are in the data
+ *          rings instead, and this is the request's entry in queue->spans
+ * @out_data: the message, tc->sdata of the 9p request, kept to submit it
+ *         again after a reconnect
+ * @in_data: where the reply is copied to, rc->sdata of the 9p request
+ * @nr_msg_segs, @nr_reply_segs: segments of an indirect request that
+ *          carry the message and the reply; 0 for a direct request
+ * @nr_out_segs, @nr_segs: segments read by the backend, and all segments
+ * @zc_out, @zc_in: zero copy payloads; their page arrays are handed back
+ *            to trans_xen9p.c when the response arrives
+ * @zc_pinned: the zero copy pages are pinned user pages
+ * @reply_len: bytes of reply copied out by copy_reply
+ * @rsp:  copy of the response, taken off the ring by p9_complete
+ * @type: 9p message type of the request, for the latency histograms
+ * @t_queued, @t_pushed, @t_consumed: when the request was handed to the
+ *        transport, written to the ring, and its response taken off it
+ * @cancelled: the 9p client gave up on the request (p9front_cancel); its
+ *        response only frees the id and pages, the reply buffer and tag
+ *        may already belong to another request
+ * @completing: the response has been taken off the ring and is being
+ *        handed to the client
+ *
+ * Indirect segments are laid out message, zero copy out, reply, zero copy
+ * in; a direct request only has the zero copy ones in req.seg.
+ *
+ */
+struct p9_shadow {
+	p9_request_t		req;
+	struct list_head	grants;
+	struct grant		*indirect[P9_MAX_INDIRECT_PAGES_PER_REQUEST];
+	struct grant		*slot;
+	unsigned int		slot_offset;
+	bool			data_ring;
+	unsigned int		span;
+	char			*out_data;
+	char			*in_data;
+	unsigned int		nr_msg_segs;
+	unsigned int		nr_reply_segs;
+	unsigned int		nr_out_segs;
+	unsigned int		nr_segs;
+	struct p9_zc_payload	zc_out;
+	struct p9_zc_payload	zc_in;
+	int			zc_pinned;
+	unsigned int		reply_len;
+	struct p9_response	rsp;
+	u8			type;
+	ktime_t			t_queued;
+	ktime_t			t_pushed;
+	ktime_t			t_consumed;
+	bool			cancelled;
+	bool			completing;
+};
+
+/*
+ * struct p9_replay - a request taken off the rings of a device whose
+ *                    backend went away (suspend, migration, a backend
+ *                    restart), submitted again by p9front_replay once the
+ *                    device reconnects
+ * @queue : the queue it was on
+ * @pushed: when it was first written to a ring; requests are replayed in
+ *          that order
+ * @dropped: the 9p client gave up on it before it could be replayed
+ *
+ * The other fields are the arguments it was submitted with, see
+ * p9front_handle_client_request.  The zero copy page arrays stay with
+ * the request; their grants were revoked with the old rings.
+ */
+struct p9_replay {
+	unsigned int		queue;
+	u16			tag;
+	char			*out_data;
+	unsigned int		out_len;
+	char			*in_data;
+	unsigned int		in_len;
+	struct p9_zc_payload	zc_out;
+	struct p9_zc_payload	zc_in;
+	int			zc_pinned;
+	ktime_t			queued;
+	ktime_t			pushed;
+	bool			dropped;
+};
+
+/*
+ * struct p9_data_ring - a byte ring shared with the backend for the life
+ *                       of the queue (see Data rings in p9.h)
+ * @buf : the ring, @size bytes of contiguous pages
+ * @ref : the grant of each page
+ * @prod, @cons: bytes handed out and given back, free running
+ *
+ * A span is taken at @prod and may not wrap: when it does not fit before
+ * the end of the ring, the bytes up to the end are skipped and given back
+ * along with it.  Spans are given back in the order they were taken, see
+ * struct p9_data_span in p9_pack.h.
+ */
+struct p9_data_ring {
+	char			*buf;
+	unsigned int		size;
+	u32			prod;
+	u32			cons;
+	grant_ref_t		ref[P9_MAX_DATA_RING_PAGES];
+};
+
+/*
+ * struct p9_queue_stats - counters of a queue, shown in debugfs
+ *                         p9front/<device>/stats; updated under ring_lock,
+ *                         except @interrupts which only p9_interrupt touches
+ * @requests, @responses: requests put on the ring and responses taken off it
+ * @indirect : requests sent as indirect requests
+ * @data_ring: requests whose message and reply went through the data rings
+ * @data_ring_full: requests that fit the data rings but found them full,
+ *             and went through the pool instead
+ * @out_bytes: message and zero copy bytes sent to the backend
+ * @in_bytes : reply bytes copied back, plus the zero copy room given for
+ *             reads
+ * @inflight_max: most requests on the ring at once
+ * @pool_pages: data pages in the pool, free or not
+ * @zc_grants: zero copy pages granted to the backend right now
+ * @slots    : per size class, slots of direct requests in use
+ * @notify, @notify_suppressed: pushes of the ring that did and did not
+ *             need an event sent to the backend
+ * @interrupts: events from the backend
+ * @ring_full: submissions turned away with -ENOSPC
+ * @batches, @batch_max: drains of the submission list that found work,
+ *             and the most requests one of them put on the ring
+ * @cancelled: requests the 9p client gave up on
+ * @cancelled_inflight: of those, the ones the backend has not answered yet
+ */
+struct p9_queue_stats {
+	unsigned long		requests;
+	unsigned long		responses;
+	unsigned long		indirect;
+	unsigned long		data_ring;
+	unsigned long		data_ring_full;
+	u64			out_bytes;
+	u64			in_bytes;
+	unsigned int		inflight_max;
+	unsigned int		pool_pages;
+	unsigned long		zc_grants;
+	unsigned int		slots[P9_NR_SLOT_CLASSES];
+	unsigned long		notify;
+	unsigned long		notify_suppressed;
+	unsigned long		interrupts;
+	unsigned long		ring_full;
+	unsigned long		batches;
+	unsigned int		batch_max;
+	unsigned long		cancelled;
+	unsigned int		cancelled_inflight;
+};
+
+/* bit in p9_front_queue.submit_flags */
+#define P9_QUEUE_SUBMIT_OWNER	0
+
+/*
+ * struct p9_front_queue - one shared ring with its own event channel
+ * @ring_lock: protects the ring, @grants and @shadow of this queue
+ * @id       : index of the queue, N in the queue-N xenstore subdirectory
+ * @ring_ref : grefs for the pages of the ring
+ * @evtchn, @irq: event channel and the irq it is bound to
+ * @name     : irq name, p9 or p9-qN
+ * @grants   : pool of free data pages, one per ring slot plus room for
+ *             the pages of indirect requests
+ * @nr_free  : number of pages in @grants; the last P9_FLUSH_RESERVE of
+ *             them are kept for Tflush
+ * @persistent_gnts_c: number of pages in @grants that are already granted
+ * @slot_pages: per size class, pages carved into slots with some free
+ * @shadow   : per request id data pages and addresses where data is
+ *             xferred from/to, one entry per ring slot
+ * @shadow_free: first free request id; free ids are chained through the
+ *             req.id of their @shadow entries
+ * @nr_inflight: request ids in use; the last P9_FLUSH_RESERVE of them are
+ *             kept for Tflush
+ * @ring_bufs_avail: cleared when a request finds no room on the queue, set
+ *             again by p9_interrupt once responses free some
+ * @plugged  : nesting depth of p9front_plug; requests are only pushed and
+ *             the backend notified once it drops back to 0
+ * @pending  : lock free list of requests waiting to be put on the ring,
+ *             drained in batches by the submit owner
+ * @submit_flags: P9_QUEUE_SUBMIT_OWNER while a submitter is draining
+ *             @pending, see p9front_handle_client_request
+ * @node     : memory node of the vCPUs submitting on the queue, where its
+ *             ring, shadow requests and data pages are allocated; the
+ *             event channel is hinted to that node's CPUs too
+ * @tasklet  : takes the responses off the ring, scheduled by p9_interrupt
+ * @data_out, @data_in: the data rings, when info->nr_data_ring_pages is set
+ * @spans    : the data ring spans of requests in flight, RING_SIZE of
+ *             them, oldest at @span_tail; @span_head is the next to take
+ * @stats    : counters for debugfs
+ * @info     : the device this queue belongs to
+ *
+ */
+struct p9_front_queue {
+	spinlock_t		ring_lock;
+	unsigned int		id;
+	grant_ref_t		ring_ref[P9_MAX_RING_PAGES];
+	struct p9_front_ring	ring;
+	unsigned int		evtchn;
+	unsigned int		irq;
+	char			name[16];
+	struct list_head	grants;
+	unsigned int		nr_free;
+	unsigned int		persistent_gnts_c;
+	struct list_head	slot_pages[P9_NR_SLOT_CLASSES];
+	struct p9_shadow	*shadow;
+	unsigned long		shadow_free;
+	unsigned int		nr_inflight;
+	int			ring_bufs_avail;
+	unsigned int		plugged;
+	struct llist_head	pending;
+	unsigned long		submit_flags;
+	int			node;
+	struct tasklet_struct	tasklet;
+	struct p9_data_ring	data_out;
+	struct p9_data_ring	data_in;
+	struct p9_data_span	*spans;
+	unsigned int		span_head;
+	unsigned int		span_tail;
+	struct p9_queue_stats	stats;
+	struct p9_front_info	*info;
 };
 
 /*
  * struct 9pfront_info - per-instance "device" information
  *                  device specific information including xendev associated with
  *                    this channel
- * @io_lock : protects multiple elements within this structure
+ * @io_lock : protects the connection state
  * @mutex   : ditto
  * @xbdev   : xenbus device info
  * @chan    : per instance transport info
@@ -100,10 +438,37 @@ struct grant {
  *          This is not optimal, but allows me to make as few changes as 
  *          possible to template code.
  * @p9state  : connected, disconnected or suspended
- * @ring_ref : gref for the ring
- * @page     : current page being worked on - temp while only one
- * @offset   : offset in page for next request's data - ditto on temp
- * @addresses: addresses where data is xferred from/to per request
+ * @nr_ring_pages: number of pages in each ring, a power of 2
+ * @feature_persistent: backend keeps our grants mapped across requests
+ * @queues   : the rings, @nr_queues of them, negotiated through
+ *             multi-queue-max-queues / multi-queue-num-queues
+ * @max_indirect_segments: largest indirect request, in segments; 0 when
+ *             the backend does not support indirect requests
+ * @max_request_size: largest 9p message the backend takes, from its
+ *             max-request-size node; 0 if it sets no limit
+ * @max_msize: largest msize the device can carry, from the two above;
+ *             p9_xen_create clamps the client's msize to it
+ * @nr_data_ring_pages: pages in each data ring of a queue, 0 when the
+ *             device does not use data rings
+ * @loop     : the loopback backend serving this device (p9_loop.c), NULL
+ *             for a xenbus device
+ * @latency  : latency histograms, shown in debugfs p9front/<device>/latency
+ * @debugfs  : the debugfs directory of the device, holding latency and
+ *             stats
+ * @replay, @nr_replay: requests in flight when the rings were last torn
+ *             down, waiting to be submitted again; under p9front_mutex
+ * @replay_work: submits @replay once the backend connects, off the
+ *             xenwatch thread
+ * @is_ready : new requests may be submitted; clear while the device is
+ *             disconnected and while @replay is being submitted
+ * @inflight : request ids in use across the queues, for multipath
+ *             least-outstanding selection
+ * @queue_map: per vCPU, the queue it submits on
+ * @srcu     : read side held by submitters and pollers while they use a
+ *             queue; p9_free waits for them before freeing the queues
+ * @kref     : one reference for the device, one for each mount using its
+ *             channel; the last frees the info and its channel
+ * @removed  : the device is gone for good, requests fail with EIO
  *
  *
  */
@@ -113,16 +478,27 @@ struct p9_front_info {
 	struct mutex	 	mutex;
 	struct xenbus_device 	*xbdev;
 	enum p9_state 		connected;
-	int			ring_ref;
-	struct p9_front_ring 	ring;
-	unsigned int 		evtchn;
-	unsigned int		irq;
-	struct list_head	grants;
-	struct page		*page;
-	unsigned int		offset;
-	void 			*addresses[PAGE_SIZE];	
+	unsigned int		nr_ring_pages;
+	unsigned int		feature_persistent:1;
+	struct p9_front_queue	*queues;
+	unsigned int		nr_queues;
+	unsigned int		max_indirect_segments;
+	unsigned int		max_request_size;
+	unsigned int		max_msize;
+	unsigned int		nr_data_ring_pages;
+	struct p9_loop		*loop;
+	struct p9_latency	*latency;
+	struct dentry		*debugfs;
+	struct p9_replay	*replay;
+	unsigned int		nr_replay;
+	struct work_struct	replay_work;
 	struct xen9p_chan 	*chan;
 	int			is_ready;
+	atomic_t		inflight;
+	unsigned int		*queue_map;
+	struct srcu_struct	srcu;
+	struct kref		kref;
+	bool			removed;
 };
 
 /* 
@@ -139,14 +515,50 @@ void cleanup_xen_9p(void);
  */
 int talk_to_9p_back(struct xenbus_device *dev, struct p9_front_info *info);
 void p9_free(struct p9_front_info *info, int suspend);
+int p9front_init_info(struct p9_front_info *info, struct xen9p_chan *chan);
+void p9front_remove(struct p9_front_info *info);
+void p9front_get(struct p9_front_info *info);
+void p9front_put(struct p9_front_info *info);
 void p9front_connect(struct p9_front_info *info);
 void p9front_closing(struct p9_front_info *info);
-void p9_handle_response(struct p9_response *bret,
-			struct p9_front_info *info);
-int p9front_handle_client_request (struct p9_front_info *info,
+void p9_handle_response(struct p9_shadow *shadow,
+			struct p9_front_queue *queue);
+struct p9_front_queue *p9front_select_queue(struct p9_front_info *info);
+int p9front_poll(struct p9_front_queue *queue);
+void p9front_plug(struct p9_front_queue *queue);
+void p9front_unplug(struct p9_front_queue *queue);
+int p9front_handle_client_request (struct p9_front_queue *queue,
 				    uint16_t tag,
 				    char *out_data, int out_len,
-				    char *in_data, int in_len);
-void req_done(void *metadata, struct xen9p_chan *chan, int16_t status,
-	      uint16_t tag);
+				    char *in_data, int in_len,
+				    struct p9_zc_payload *zc_out,
+				    struct p9_zc_payload *zc_in,
+				    int zc_pinned, ktime_t queued);
+void p9front_event(struct p9_front_queue *queue);
+int p9front_cancel(struct p9_front_info *info, u16 tag);
+int p9front_ring_avail(struct p9_front_info *info, unsigned int id);
+unsigned int p9front_max_msize(struct p9_front_info *info);
+int p9front_data_ring_fits(struct p9_front_info *info, unsigned int out_len,
+			   unsigned int in_len, unsigned int nr_zc_segs);
+int p9front_loop_attach(struct p9_front_info *info, unsigned int nr_queues);
+void p9front_debugfs_register(void);
+void p9front_debugfs_unregister(void);
+void p9front_debugfs_add(struct p9_front_info *info);
+void p9front_debugfs_remove(struct p9_front_info *info);
+void req_done(struct xen9p_chan *chan, int16_t status, uint16_t tag);
+void p9_xen_req_error(struct xen9p_chan *chan, u16 tag, char *in_data,
+		      int err);
+void p9_xen_zc_release(struct page **pages, int nr_pages, int pinned);
 void p9_xen_close(struct p9_client *client);
+void p9_xen_add_chan(struct xen9p_chan *chan);
+void p9_xen_del_chan(struct xen9p_chan *chan);
+void p9_xen_set_session(struct xen9p_chan *chan, char *session);
+
+/*
+ * loopback backend, p9_loop.c
+ */
+int p9_loop_init(void);
+void p9_loop_exit(void);
+int p9_loop_grant(struct p9_loop *loop, unsigned long pfn);
+void p9_loop_end_grant(struct p9_loop *loop, grant_ref_t gref);
+void p9_loop_kick(struct p9_loop *loop, unsigned int queue);